@@ -2,9 +2,17 @@
 
 // input data : sent from main program
 layout (location = 0) in vec3 vertexPosition;
-layout (location = 1) in vec3 vertexColor;
+layout (location = 1) in vec4 vertexColor; // normalised RGBA8
 
-uniform mat4 MVP;
+// Per-frame camera, shared by every program
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+
+// Per-object model transform, a slot of the streamed model buffer
+layout (std140) uniform Model {
+    mat4 M;
+};
 
 // output data : used by fragment shader
 out vec3 fragColor;
@@ -15,8 +23,8 @@ void main ()
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
-    fragColor = vertexColor;
+    fragColor = vertexColor.rgb;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    // Output position of the vertex, in clip space : VP * M * position
+    gl_Position = VP * (M * v);
 }
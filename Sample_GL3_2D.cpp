@@ -1,8 +1,12 @@
 #include <iostream>
 #include <cmath>
+#include <cstring>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <fstream>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <ao/ao.h>
 #include <mpg123.h>
 
@@ -10,17 +14,29 @@
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <cstdint>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+
+// Generated by the makefile: each .vert/.frag file as a string constant
+#include "shaders.h"
+
 #define BITS 8
 
 
 using namespace std;
 //GLOBAL COUNT MOVES
-GLint count=0;
+GLint movecount=0;
 
 //GLOBAL LIVES
 GLint lives=3;
@@ -51,28 +67,280 @@ GLdouble newleftmouse_y;
 //Theta definition Where
 GLdouble theta=0.0f;
 
+//PROFILER
+//PROFILE_ZONE("name") times the rest of the enclosing scope. A zone costs two
+//steady_clock reads and one store into its thread's ring of the latest
+//PROFILE_EVENTS zones, so zones stay compiled in. The rings are written as
+//Chrome trace-event JSON (chrome://tracing, Perfetto) on F12 and at exit.
+#define PROFILE_EVENTS (1 << 16)
+
+typedef struct ProfileEvent {
+    const char* name; //Must outlive the trace, e.g. a string literal
+    int64_t begin, end; //Nanoseconds on the steady clock
+} ProfileEvent;
+
+struct ProfileBuffer {
+    ProfileEvent events[PROFILE_EVENTS];
+    uint64_t count; //Zones ever recorded; the ring keeps the last PROFILE_EVENTS
+    int thread;
+};
+
+//Every thread's ring, registered on its first zone
+vector<ProfileBuffer*> profile_buffers;
+std::mutex profile_mutex;
+
+//Where F12 and exit write the trace; exit only writes when --trace was given
+string trace_path = "trace.json";
+bool trace_at_exit = false;
+
+inline int64_t profilenow ()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProfileBuffer* registerprofilebuffer ()
+{
+    ProfileBuffer* buffer = new ProfileBuffer;
+    buffer->count = 0;
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    buffer->thread = profile_buffers.size();
+    profile_buffers.push_back(buffer);
+    return buffer;
+}
+
+inline void profilerecord (const char* name, int64_t begin, int64_t end)
+{
+    static thread_local ProfileBuffer* buffer = registerprofilebuffer();
+    ProfileEvent& event = buffer->events[buffer->count++ % PROFILE_EVENTS];
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+}
+
+struct ProfileZone {
+    const char* name;
+    int64_t begin;
+    explicit ProfileZone (const char* n) : name(n), begin(profilenow()) {}
+    ~ProfileZone () { profilerecord(name, begin, profilenow()); }
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profilezone_, __LINE__)(name)
+
+/* Write the recorded zones of every thread as Chrome trace-event JSON */
+void writetrace (const string& path)
+{
+    FILE* out = fopen(path.c_str(), "w");
+    if(!out)
+    {
+        fprintf(stderr, "Profiler: could not write %s\n", path.c_str());
+        return;
+    }
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char* separator = "\n";
+    size_t written = 0;
+    for(size_t t = 0; t < profile_buffers.size(); t++)
+    {
+        const ProfileBuffer* buffer = profile_buffers[t];
+        uint64_t first = buffer->count > PROFILE_EVENTS ? buffer->count - PROFILE_EVENTS : 0;
+        for(uint64_t k = first; k < buffer->count; k++)
+        {
+            const ProfileEvent& event = buffer->events[k % PROFILE_EVENTS];
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    separator, event.name, buffer->thread, event.begin/1000.0, (event.end - event.begin)/1000.0);
+            separator = ",\n";
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    fprintf(stderr, "Profiler: wrote %zu zones to %s\n", written, path.c_str());
+}
+
+//GL STATE CACHE
+//Last state set through the cached* calls below. Calls that would not change
+//it are skipped; both kinds are counted per frame along with draw calls.
+struct GLState {
+    GLuint program;
+    GLuint vertexarray;
+    GLuint arraybuffer;
+    GLuint uniformbuffer;
+    GLenum fillmode;
+    GLint issued, skipped, draws;
+} glstate;
+
+void cachedUseProgram (GLuint program)
+{
+    if(glstate.program == program) { glstate.skipped++; return; }
+    glUseProgram(program);
+    glstate.program = program;
+    glstate.issued++;
+}
+
+void cachedBindVertexArray (GLuint vertexarray)
+{
+    if(glstate.vertexarray == vertexarray) { glstate.skipped++; return; }
+    glBindVertexArray(vertexarray);
+    glstate.vertexarray = vertexarray;
+    glstate.issued++;
+}
+
+//Only the GL_ARRAY_BUFFER and GL_UNIFORM_BUFFER bindings are tracked
+void cachedBindBuffer (GLenum target, GLuint buffer)
+{
+    GLuint& bound = (target == GL_UNIFORM_BUFFER) ? glstate.uniformbuffer : glstate.arraybuffer;
+    if(bound == buffer) { glstate.skipped++; return; }
+    glBindBuffer(target, buffer);
+    bound = buffer;
+    glstate.issued++;
+}
+
+void cachedPolygonMode (GLenum fillmode)
+{
+    if(glstate.fillmode == fillmode) { glstate.skipped++; return; }
+    glPolygonMode(GL_FRONT_AND_BACK, fillmode);
+    glstate.fillmode = fillmode;
+    glstate.issued++;
+}
+
+//GPU RESOURCES
+//Kinds of GL object owned through GLObject
+enum GLKind { GLK_VERTEXARRAY, GLK_BUFFER, GLK_PROGRAM, GLK_FRAMEBUFFER, GLK_RENDERBUFFER, GLK_QUERY, GLK_COUNT };
+
+//Live GL objects per kind; a count that keeps growing is a leak
+GLint gl_live[GLK_COUNT];
+//Cleared when the context goes away, after which handles are dropped without GL calls
+bool gl_context_alive = true;
+
+//Owning handle of one GL object. Handles are move-only and delete their
+//object when destroyed or overwritten.
+class GLObject {
+public:
+    GLObject () : kind(GLK_BUFFER), id(0) {}
+
+    explicit GLObject (GLKind k) : kind(k), id(0)
+    {
+        if(k==GLK_VERTEXARRAY)
+            glGenVertexArrays(1, &id);
+        else if(k==GLK_BUFFER)
+            glGenBuffers(1, &id);
+        else if(k==GLK_FRAMEBUFFER)
+            glGenFramebuffers(1, &id);
+        else if(k==GLK_RENDERBUFFER)
+            glGenRenderbuffers(1, &id);
+        else if(k==GLK_QUERY)
+            glGenQueries(1, &id);
+        else
+            id = glCreateProgram();
+        gl_live[kind]++;
+    }
+
+    //Adopt an object created elsewhere, e.g. a linked program
+    GLObject (GLKind k, GLuint handle) : kind(k), id(handle)
+    {
+        if(id)
+            gl_live[kind]++;
+    }
+
+    GLObject (GLObject&& o) : kind(o.kind), id(o.id) { o.id = 0; }
+
+    GLObject& operator= (GLObject&& o)
+    {
+        if(this != &o)
+        {
+            reset();
+            kind = o.kind;
+            id = o.id;
+            o.id = 0;
+        }
+        return *this;
+    }
+
+    ~GLObject () { reset(); }
+
+    void reset ()
+    {
+        if(!id)
+            return;
+        if(gl_context_alive)
+        {
+            if(kind==GLK_VERTEXARRAY)
+                glDeleteVertexArrays(1, &id);
+            else if(kind==GLK_BUFFER)
+                glDeleteBuffers(1, &id);
+            else if(kind==GLK_FRAMEBUFFER)
+                glDeleteFramebuffers(1, &id);
+            else if(kind==GLK_RENDERBUFFER)
+                glDeleteRenderbuffers(1, &id);
+            else if(kind==GLK_QUERY)
+                glDeleteQueries(1, &id);
+            else
+                glDeleteProgram(id);
+        }
+        // Deleting a bound object unbinds it, and GL may hand the name out again
+        if(kind==GLK_VERTEXARRAY && glstate.vertexarray==id)
+            glstate.vertexarray = 0;
+        if(kind==GLK_BUFFER && glstate.arraybuffer==id)
+            glstate.arraybuffer = 0;
+        if(kind==GLK_BUFFER && glstate.uniformbuffer==id)
+            glstate.uniformbuffer = 0;
+        if(kind==GLK_PROGRAM && glstate.program==id)
+            glstate.program = 0;
+        gl_live[kind]--;
+        id = 0;
+    }
+
+    operator GLuint () const { return id; }
+
+private:
+    GLObject (const GLObject&);
+    GLObject& operator= (const GLObject&);
+
+    GLKind kind;
+    GLuint id;
+};
+
 struct VAO {
-    GLuint VertexArrayID;
-    GLuint VertexBuffer;
-    GLuint ColorBuffer;
+    GLObject VertexArrayID;
+    GLObject VertexBuffer;
+    GLObject ColorBuffer;
+    GLObject IndexBuffer; //Only for indexed objects, with NumIndices > 0
 
     GLenum PrimitiveMode;
     GLenum FillMode;
     int NumVertices;
+    int NumIndices;
 };
 typedef struct VAO VAO;
-//Define the type of view
-std::string view="default";
-GLint flag=1;
+
+//Interleaved vertex of indexed meshes: SNORM16 position, so a local mesh
+//must fit within one world unit, and normalised RGBA8 colour
+typedef struct PackedVertex {
+    GLshort x, y, z, w;
+    GLubyte r, g, b, a;
+} PackedVertex;
+//Cameras the main view can use
+enum View { VIEW_DEFAULT, VIEW_TOP, VIEW_BLOCK, VIEW_FOLLOW, VIEW_HELICOPTER };
+View view = VIEW_DEFAULT;
 
 struct GLMatrices {
     glm::mat4 projectionO, projectionP;
     glm::mat4 model;
     glm::mat4 view;
-    GLuint MatrixID;
+    glm::mat4 VP;
 } Matrices;
 
-GLuint programID;
+//Uniform buffer binding point of the per-view "Camera" block
+#define CAMERA_BINDING 0
+
+//Top-view inset drawn over the main view
+bool minimap = false;
+glm::mat4 minimapview;
+
+GLObject programID;
+GLObject instancedProgramID;
 int proj_type;
 glm::vec3 tri_pos, rect_pos;
 
@@ -82,6 +350,13 @@ typedef struct COLOR {
     float b;
 } COLOR;
 
+//Cached model transform of an object
+typedef struct Transform {
+    GLfloat x, y, z;  //Position the cached matrix was built from
+    GLint dirty;      //Set whenever rotate_matrix changes
+    glm::mat4 model;  //translate_matrix*rotate_matrix
+} Transform;
+
 //Draw the struct base object
 typedef struct Base {
 	string name;
@@ -109,14 +384,15 @@ typedef struct Base {
 	GLfloat weight;
     glm::mat4 translate_matrix;
     glm::mat4 rotate_matrix;
+    Transform transform;
 }Base;
 
-//Previous handler
-string previous;
-//ACTIVATED PART OF Block
-string activated="n";
 
 //AUDIO INITIALISATION
+//--noaudio (and --headless, which implies it) leaves the sound system alone.
+//Without an output device (ao_open_live failing on a box with no sound
+//card) the music is skipped as well rather than handing ao_play a NULL.
+bool noaudio = false;
 mpg123_handle *mh;
 unsigned char *buffer;
 size_t buffer_size;
@@ -131,6 +407,8 @@ int channels, encoding;
 long rate;
 
 void audio_init() {
+    if (noaudio)
+        return;
     /* initializations */
     ao_initialize();
     driver = ao_default_driver_id();
@@ -153,6 +431,9 @@ void audio_init() {
 }
 
 void audio_play() {
+    if (noaudio || !dev)
+        return;
+    PROFILE_ZONE("audio_play");
     /* decode and play */
     if (mpg123_read(mh, buffer, buffer_size, &done) == MPG123_OK)
         ao_play(dev, (char*) buffer, done);
@@ -160,9 +441,12 @@ void audio_play() {
 }
 
 void audio_close() {
+    if (noaudio)
+        return;
     /* clean up */
     free(buffer);
-    ao_close(dev);
+    if (dev)
+        ao_close(dev);
     mpg123_close(mh);
     mpg123_delete(mh);
     mpg123_exit();
@@ -170,86 +454,168 @@ void audio_close() {
 }
 
 
-struct Base tiles[100][100];
 struct Base Blockobj;
 
-std::string bstatus = "up";
-std::string level="level1";
+//How the block rests. A lying block covers two cells and (i, j) tracks one
+//of them: the one with the lower or the higher index along the block.
+enum Orientation { STANDING, ALONG_I_LOW, ALONG_I_HIGH, ALONG_J_LOW, ALONG_J_HIGH, ORIENTATIONS };
+Orientation orientation = STANDING;
+//Current level, from 1
+int level = 1;
 
 
-/* Function to load Shaders - Use it as it is */
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+//SHADERS
+//Sources are embedded at build time from shaders.h, see the makefile
 
-    // Create the shaders
-    GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-    GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-    // Read the Vertex Shader code from the file
-    std::string VertexShaderCode;
-    std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-    if(VertexShaderStream.is_open())
-	{
-	    std::string Line = "";
-	    while(getline(VertexShaderStream, Line))
-		VertexShaderCode += "\n" + Line;
-	    VertexShaderStream.close();
-	}
-
-    // Read the Fragment Shader code from the file
-    std::string FragmentShaderCode;
-    std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-    if(FragmentShaderStream.is_open()){
-	std::string Line = "";
-	while(getline(FragmentShaderStream, Line))
-	    FragmentShaderCode += "\n" + Line;
-	FragmentShaderStream.close();
-    }
+/* Compile one shader stage, logging the compiler output on failure; returns 0 on failure */
+GLuint CompileShader(GLenum type, const char * source, const char * name) {
+    GLuint ShaderID = glCreateShader(type);
+    glShaderSource(ShaderID, 1, &source , NULL);
+    glCompileShader(ShaderID);
 
     GLint Result = GL_FALSE;
     int InfoLogLength;
+    glGetShaderiv(ShaderID, GL_COMPILE_STATUS, &Result);
+    glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if(!Result)
+    {
+        std::vector<char> ShaderErrorMessage( max(InfoLogLength, int(1)) );
+        glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+        fprintf(stderr, "Compiling shader %s failed:\n%s\n", name, &ShaderErrorMessage[0]);
+        glDeleteShader(ShaderID);
+        return 0;
+    }
+    return ShaderID;
+}
+
+/* Function to load Shaders - compiles and links the embedded sources; returns 0 on failure */
+GLuint LoadShaders(const char * vertex_source, const char * fragment_source, const char * name, bool retrievable=false) {
 
-    // Compile Vertex Shader
-    //    printf("Compiling shader : %s\n", vertex_file_path);
-    char const * VertexSourcePointer = VertexShaderCode.c_str();
-    glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-    glCompileShader(VertexShaderID);
-
-    // Check Vertex Shader
-    glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> VertexShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-    //    fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
-
-    // Compile Fragment Shader
-    //    printf("Compiling shader : %s\n", fragment_file_path);
-    char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-    glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-    glCompileShader(FragmentShaderID);
-
-    // Check Fragment Shader
-    glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-    glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
-    glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-    //    fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+    GLuint VertexShaderID = CompileShader(GL_VERTEX_SHADER, vertex_source, name);
+    GLuint FragmentShaderID = CompileShader(GL_FRAGMENT_SHADER, fragment_source, name);
+    if(!VertexShaderID || !FragmentShaderID)
+    {
+        glDeleteShader(VertexShaderID);
+        glDeleteShader(FragmentShaderID);
+        return 0;
+    }
 
     // Link the program
-    //    fprintf(stdout, "Linking program\n");
     GLuint ProgramID = glCreateProgram();
+    if(retrievable)
+        glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glAttachShader(ProgramID, VertexShaderID);
     glAttachShader(ProgramID, FragmentShaderID);
     glLinkProgram(ProgramID);
 
+    glDeleteShader(VertexShaderID);
+    glDeleteShader(FragmentShaderID);
+
     // Check the program
+    GLint Result = GL_FALSE;
+    int InfoLogLength;
     glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
     glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-    std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
-    glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-    //    fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+    if(!Result)
+    {
+        std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
+        glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        fprintf(stderr, "Linking program %s failed:\n%s\n", name, &ProgramErrorMessage[0]);
+        glDeleteProgram(ProgramID);
+        return 0;
+    }
 
-    glDeleteShader(VertexShaderID);
-    glDeleteShader(FragmentShaderID);
+    return ProgramID;
+}
+
+//PROGRAM BINARY CACHE
+//Linked programs are saved with glGetProgramBinary under SHADER_CACHE_DIR, in
+//a file named after a hash of their sources and of the driver strings, so warm
+//starts skip GLSL compilation. A missing, stale or rejected binary falls back
+//to LoadShaders and is replaced.
+#define SHADER_CACHE_DIR "shadercache"
+
+//Leading fields of a cache file, followed by the binary itself
+typedef struct ProgramBinaryHeader {
+    char magic[4];
+    GLenum format;
+    GLint length;
+} ProgramBinaryHeader;
+
+//Programs taken from the cache and compiled this run
+int programs_cached, programs_compiled;
+
+unsigned long long fnv1a(const string& data, unsigned long long hash=14695981039346656037ULL)
+{
+    for(size_t k = 0; k < data.size(); k++)
+        hash = (hash ^ (unsigned char)data[k]) * 1099511628211ULL;
+    return hash;
+}
+
+string programcachepath(const char * vertex_source, const char * fragment_source, const char * name)
+{
+    string driver = string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER) + "|" + (const char*)glGetString(GL_VERSION);
+    unsigned long long hash = fnv1a(driver);
+    hash = fnv1a(vertex_source, hash);
+    hash = fnv1a(fragment_source, hash);
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s-%016llx.bin", SHADER_CACHE_DIR, name, hash);
+    return path;
+}
+
+/* Load a program from the binary cache, or build it and store it there */
+GLuint LoadCachedProgram(const char * vertex_source, const char * fragment_source, const char * name) {
+
+    GLint formats = 0;
+    if(GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if(!formats)
+    {
+        programs_compiled++;
+        return LoadShaders(vertex_source, fragment_source, name);
+    }
+
+    string path = programcachepath(vertex_source, fragment_source, name);
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    ProgramBinaryHeader header;
+    if(in.read((char*)&header, sizeof(header)) && !memcmp(header.magic, "PGB1", 4) && header.length > 0)
+    {
+        std::vector<char> binary(header.length);
+        if(in.read(&binary[0], header.length))
+        {
+            GLuint ProgramID = glCreateProgram();
+            glProgramBinary(ProgramID, header.format, &binary[0], header.length);
+            GLint Result = GL_FALSE;
+            glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+            if(Result)
+            {
+                programs_cached++;
+                return ProgramID;
+            }
+            glDeleteProgram(ProgramID);
+        }
+        fprintf(stderr, "Shader cache: %s was rejected, recompiling %s\n", path.c_str(), name);
+    }
+    in.close();
+
+    programs_compiled++;
+    GLuint ProgramID = LoadShaders(vertex_source, fragment_source, name, true);
+    if(!ProgramID)
+        return 0;
+
+    GLint length = 0;
+    glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0)
+        return ProgramID;
+    std::vector<char> binary(length);
+    memcpy(header.magic, "PGB1", 4);
+    glGetProgramBinary(ProgramID, length, &header.length, &header.format, &binary[0]);
+
+    mkdir(SHADER_CACHE_DIR, 0755);
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!out.write((const char*)&header, sizeof(header)) || !out.write(&binary[0], header.length))
+        fprintf(stderr, "Shader cache: could not write %s\n", path.c_str());
 
     return ProgramID;
 }
@@ -259,8 +625,339 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+//GPU TIMERS
+//Passes are bracketed by GL_TIMESTAMP queries, which unlike GL_TIME_ELAPSED
+//may overlap, so a view's passes can be timed inside the view itself. Each
+//frame's queries are read back GPU_TIMER_FRAMES frames later, when the slot
+//comes round again; results not ready by then are dropped instead of waited for.
+enum GPUPass { GPU_FRAME, GPU_TILES, GPU_BLOCK, GPU_OVERLAYS, GPU_PASSES };
+const char* gpu_pass_names[GPU_PASSES] = { "FRAME", "TILES", "BLOCK", "OVERLAYS" };
+
+#define GPU_TIMER_FRAMES 4
+#define GPU_TIMER_SPANS 16
+
+//Enabled with --benchmark when timer queries are available
+bool gpu_timers = false;
+
+struct GPUTimers {
+    GLObject queries[GPU_TIMER_FRAMES][2*GPU_TIMER_SPANS]; //Begin and end timestamp of each span
+    GPUPass pass[GPU_TIMER_FRAMES][GPU_TIMER_SPANS];
+    int spans[GPU_TIMER_FRAMES];
+    int frame;                    //Slot being recorded
+    int open[GPU_PASSES];         //Span of each pass begun and not yet ended
+    double last[GPU_PASSES];      //Milliseconds of the latest resolved frame
+    vector<double> ms[GPU_PASSES];
+    GLint dropped;
+} gputimers;
+
+void createGPUTimers ()
+{
+    for(int f = 0; f < GPU_TIMER_FRAMES; f++)
+        for(int q = 0; q < 2*GPU_TIMER_SPANS; q++)
+            gputimers.queries[f][q] = GLObject(GLK_QUERY);
+    for(int p = 0; p < GPU_PASSES; p++)
+        gputimers.open[p] = -1;
+}
+
+void gpubegin (GPUPass p)
+{
+    int& spans = gputimers.spans[gputimers.frame];
+    gputimers.open[p] = -1;
+    if(!gpu_timers || spans == GPU_TIMER_SPANS)
+        return;
+    gputimers.pass[gputimers.frame][spans] = p;
+    gputimers.open[p] = spans;
+    glQueryCounter(gputimers.queries[gputimers.frame][2*spans], GL_TIMESTAMP);
+    spans++;
+}
+
+void gpuend (GPUPass p)
+{
+    if(!gpu_timers || gputimers.open[p] < 0)
+        return;
+    glQueryCounter(gputimers.queries[gputimers.frame][2*gputimers.open[p] + 1], GL_TIMESTAMP);
+    gputimers.open[p] = -1;
+}
+
+/* Close the frame's spans and resolve the oldest frame if its queries are done */
+void gpuendframe ()
+{
+    if(!gpu_timers)
+        return;
+    gputimers.frame = (gputimers.frame + 1) % GPU_TIMER_FRAMES;
+
+    int f = gputimers.frame, spans = gputimers.spans[f];
+    gputimers.spans[f] = 0;
+    if(!spans)
+        return;
+    for(int q = 0; q < 2*spans; q++)
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(gputimers.queries[f][q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(!available)
+        {
+            gputimers.dropped++;
+            return;
+        }
+    }
+
+    double total[GPU_PASSES] = {0};
+    bool seen[GPU_PASSES] = {false};
+    for(int k = 0; k < spans; k++)
+    {
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(gputimers.queries[f][2*k], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(gputimers.queries[f][2*k + 1], GL_QUERY_RESULT, &end);
+        total[gputimers.pass[f][k]] += (end - begin)/1e6;
+        seen[gputimers.pass[f][k]] = true;
+    }
+    for(int p = 0; p < GPU_PASSES; p++)
+    {
+        gputimers.last[p] = total[p];
+        if(seen[p])
+            gputimers.ms[p].push_back(total[p]);
+    }
+}
+
+//FRAME TIMING
+//How frames are presented: synced to the display, as fast as possible, or
+//paced to target_fps by sleeping out the rest of each frame
+enum PresentMode { PRESENT_VSYNC, PRESENT_UNCAPPED, PRESENT_FIXED };
+PresentMode present_mode = PRESENT_VSYNC;
+double target_fps = 60;
+
+//--benchmark (and --headless) record the CPU time of every frame, from its
+//start until it is presented, and report the distribution at exit. Feeding
+//the music happens between frames and is reported on its own.
+bool benchmark = false;
+
+struct FrameTimes {
+    vector<double> cpu; //Milliseconds per frame
+    vector<double> audio; //Milliseconds spent feeding the music after each frame, not part of cpu
+    double first, last; //Wall clock at the start of the first and the end of the last frame
+    long draws;
+} frametimes;
+
+/* Record one frame that started at start and was ready to present at ready, in seconds */
+void recordframe (double start, double ready, double end, int draws)
+{
+    if(frametimes.cpu.empty())
+        frametimes.first = start;
+    frametimes.last = end;
+    frametimes.cpu.push_back(1000*(ready - start));
+    frametimes.draws += draws;
+}
+
+/* Nearest-rank percentile q of sorted values */
+double percentile (const vector<double>& sorted, double q)
+{
+    return sorted[max(0, (int)ceil(q*sorted.size()) - 1)];
+}
+
+/* Print frame-time percentiles, a histogram and the worst frames */
+void reportframes ()
+{
+    int n = frametimes.cpu.size();
+    if(!n)
+        return;
+    vector<double> sorted(frametimes.cpu);
+    sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for(int k = 0; k < n; k++)
+        total += sorted[k];
+    printf("FRAME TIMES : %d FRAMES, %.1f FPS, %.1f DRAWS/FRAME\n", n,
+           n/max(frametimes.last - frametimes.first, 1e-9), (double)frametimes.draws/n);
+    printf("CPU MS : %.3f AVG, %.3f P50, %.3f P95, %.3f P99, %.3f MAX\n",
+           total/n, percentile(sorted, 0.50), percentile(sorted, 0.95), percentile(sorted, 0.99), sorted[n-1]);
+    if(!frametimes.audio.empty())
+    {
+        vector<double> audio(frametimes.audio);
+        sort(audio.begin(), audio.end());
+        double audiototal = 0;
+        for(size_t k = 0; k < audio.size(); k++)
+            audiototal += audio[k];
+        printf("AUDIO MS : %.3f AVG, %.3f P50, %.3f P95, %.3f P99, %.3f MAX\n", audiototal/audio.size(),
+               percentile(audio, 0.50), percentile(audio, 0.95), percentile(audio, 0.99), audio.back());
+    }
+
+    // GPU passes of the frames resolved in time, and which side limits the frame
+    for(int p = 0; p < GPU_PASSES; p++)
+    {
+        vector<double> gpu(gputimers.ms[p]);
+        if(gpu.empty())
+            continue;
+        sort(gpu.begin(), gpu.end());
+        double gputotal = 0;
+        for(size_t k = 0; k < gpu.size(); k++)
+            gputotal += gpu[k];
+        printf("GPU MS %s : %.3f AVG, %.3f P50, %.3f P95, %.3f P99, %.3f MAX\n", gpu_pass_names[p],
+               gputotal/gpu.size(), percentile(gpu, 0.50), percentile(gpu, 0.95), percentile(gpu, 0.99), gpu.back());
+        if(p == GPU_FRAME)
+            printf("BOUND : %s (P50 GPU %.3f MS, CPU %.3f MS, %d FRAMES NOT READ BACK IN TIME)\n",
+                   percentile(gpu, 0.50) > percentile(sorted, 0.50) ? "GPU" : "CPU",
+                   percentile(gpu, 0.50), percentile(sorted, 0.50), gputimers.dropped);
+    }
+
+    const double bounds[] = { 0.5, 1, 2, 4, 8, 16.7, 33.3, 66.7, 1e9 };
+    const int numbins = sizeof(bounds)/sizeof(bounds[0]);
+    int bins[numbins] = {0}, peak = 1;
+    for(int k = 0; k < n; k++)
+    {
+        int b = 0;
+        while(sorted[k] >= bounds[b])
+            b++;
+        peak = max(peak, ++bins[b]);
+    }
+    double lower = 0;
+    for(int b = 0; b < numbins; b++)
+    {
+        if(b == numbins - 1)
+            printf("  %6.1f+        MS %6d ", lower, bins[b]);
+        else
+            printf("  %6.1f - %6.1f MS %6d ", lower, bounds[b], bins[b]);
+        printf("%s\n", string((bins[b]*40 + peak - 1)/peak, '#').c_str());
+        lower = bounds[b];
+    }
+
+    vector<int> worst(n);
+    for(int k = 0; k < n; k++)
+        worst[k] = k;
+    int numworst = min(n, 5);
+    partial_sort(worst.begin(), worst.begin() + numworst, worst.end(), [](int a, int b) { return frametimes.cpu[a] > frametimes.cpu[b]; });
+    printf("WORST FRAMES :");
+    for(int k = 0; k < numworst; k++)
+        printf(" #%d %.3f MS%s", worst[k], frametimes.cpu[worst[k]], k + 1 < numworst ? "," : "\n");
+}
+
+/* Sleep until the next frame is due when pacing to a fixed rate */
+void paceframe ()
+{
+    static std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    if(present_mode != PRESENT_FIXED)
+        return;
+    std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1/target_fps));
+    next += period;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    // After a long frame, restart the schedule instead of rushing to catch up
+    if(next < now)
+        next = now;
+    else
+        std::this_thread::sleep_until(next);
+}
+
+//HEADLESS
+//--headless renders into an offscreen framebuffer of a surfaceless EGL
+//context instead of a window, runs headless_frames frames and exits. There
+//is no GLFW then: time, framebuffer size and input come from here.
+bool headless = false;
+int headless_frames = 300;
+
+struct Offscreen {
+    EGLDisplay display;
+    EGLContext context;
+    int width, height;
+    GLObject framebuffer;
+    GLObject colour;
+    GLObject depth;
+} offscreen;
+
+std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+/* Seconds since start, from GLFW or, headless, from the steady clock */
+double gettime()
+{
+    if(!headless)
+        return glfwGetTime();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+/* Size of the window's framebuffer or of the offscreen one */
+void getframebuffersize(GLFWwindow* window, int* width, int* height)
+{
+    if(!headless)
+    {
+        glfwGetFramebufferSize(window, width, height);
+        return;
+    }
+    *width = offscreen.width;
+    *height = offscreen.height;
+}
+
+/* Create a surfaceless OpenGL 3.3 core context, preferring Mesa's surfaceless platform */
+void initHeadless (int width, int height)
+{
+    offscreen.width = width;
+    offscreen.height = height;
+
+    const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(extensions && strstr(extensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay)
+        offscreen.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    else
+        offscreen.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if(offscreen.display == EGL_NO_DISPLAY || !eglInitialize(offscreen.display, &major, &minor))
+    {
+        fprintf(stderr, "Headless: no EGL display (0x%x)\n", eglGetError());
+        exit(EXIT_FAILURE);
+    }
+
+    // Nothing is drawn to an EGL surface, so any surface type will do
+    const EGLint configattribs[] = { EGL_SURFACE_TYPE, 0, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    const EGLint contextattribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+                                      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numconfigs = 0;
+    eglBindAPI(EGL_OPENGL_API);
+    eglChooseConfig(offscreen.display, configattribs, &config, 1, &numconfigs);
+    if(numconfigs)
+        offscreen.context = eglCreateContext(offscreen.display, config, EGL_NO_CONTEXT, contextattribs);
+    if(!numconfigs || offscreen.context == EGL_NO_CONTEXT
+       || !eglMakeCurrent(offscreen.display, EGL_NO_SURFACE, EGL_NO_SURFACE, offscreen.context))
+    {
+        fprintf(stderr, "Headless: no surfaceless OpenGL 3.3 context (0x%x)\n", eglGetError());
+        eglTerminate(offscreen.display);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The framebuffer every headless frame is drawn into; needs GL entry points, so after initGLEW */
+void createOffscreenFramebuffer ()
+{
+    offscreen.colour = GLObject(GLK_RENDERBUFFER);
+    glBindRenderbuffer(GL_RENDERBUFFER, offscreen.colour);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, offscreen.width, offscreen.height);
+
+    offscreen.depth = GLObject(GLK_RENDERBUFFER);
+    glBindRenderbuffer(GL_RENDERBUFFER, offscreen.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, offscreen.width, offscreen.height);
+
+    offscreen.framebuffer = GLObject(GLK_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, offscreen.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreen.colour);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, offscreen.depth);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        fprintf(stderr, "Headless: offscreen framebuffer incomplete\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
 void quit(GLFWwindow *window)
 {
+    if(benchmark)
+        reportframes();
+    if(trace_at_exit)
+        writetrace(trace_path);
+    gl_context_alive = false;
+    if(headless)
+    {
+        eglMakeCurrent(offscreen.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(offscreen.display, offscreen.context);
+        eglTerminate(offscreen.display);
+        exit(EXIT_SUCCESS);
+    }
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -268,8 +965,11 @@ void quit(GLFWwindow *window)
 
 void initGLEW(void){
     glewExperimental = GL_TRUE;
-    if(glewInit()!=GLEW_OK){
-	fprintf(stderr,"Glew failed to initialize : %s\n", glewGetErrorString(glewInit()));
+    GLenum err = glewInit();
+    // A GLX build of GLEW cannot find a GLX display when headless, but the
+    // GL entry points it loads before that still work with the EGL context
+    if(err!=GLEW_OK && !(headless && GLEW_VERSION_3_3)){
+	fprintf(stderr,"Glew failed to initialize : %s\n", glewGetErrorString(err));
     }
     if(!GLEW_VERSION_3_3)
 	fprintf(stderr, "3.3 version not available\n");
@@ -283,17 +983,19 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
+    vao->NumIndices = 0;
     vao->FillMode = fill_mode;
 
     // Create Vertex Array Object
     // Should be done after CreateWindow and before any other GL calls
-    glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-    glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-    glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+    vao->VertexArrayID = GLObject(GLK_VERTEXARRAY); // VAO
+    vao->VertexBuffer = GLObject(GLK_BUFFER); // VBO - vertices
+    vao->ColorBuffer = GLObject(GLK_BUFFER);  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
+    cachedBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    cachedBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+    glEnableVertexAttribArray(0); // Stored in the VAO, so draws never re-enable it
     glVertexAttribPointer(
                           0,                  // attribute 0. Vertices
                           3,                  // size (x,y,z)
@@ -303,8 +1005,9 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           (void*)0            // array buffer offset
                           );
 
-    glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
+    cachedBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+    glEnableVertexAttribArray(1);
     glVertexAttribPointer(
                           1,                  // attribute 1. Color
                           3,                  // size (r,g,b)
@@ -320,176 +1023,1823 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 /* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-    GLfloat* color_buffer_data = new GLfloat [3*numVertices];
+    vector<GLfloat> color_buffer_data (3*numVertices);
     for (int i=0; i<numVertices; i++) {
         color_buffer_data [3*i] = red;
         color_buffer_data [3*i + 1] = green;
         color_buffer_data [3*i + 2] = blue;
     }
 
-    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+    return create3DObject(primitive_mode, numVertices, vertex_buffer_data, &color_buffer_data[0], fill_mode);
+}
+
+/* Generate VAO, interleaved VBO and index buffer and return VAO handle */
+struct VAO* createIndexed3DObject (GLenum primitive_mode, int numVertices, const PackedVertex* vertex_buffer_data, int numIndices, const GLubyte* index_buffer_data, GLenum fill_mode=GL_FILL)
+{
+    struct VAO* vao = new struct VAO;
+    vao->PrimitiveMode = primitive_mode;
+    vao->NumVertices = numVertices;
+    vao->NumIndices = numIndices;
+    vao->FillMode = fill_mode;
+
+    vao->VertexArrayID = GLObject(GLK_VERTEXARRAY);
+    vao->VertexBuffer = GLObject(GLK_BUFFER);
+    vao->IndexBuffer = GLObject(GLK_BUFFER);
+
+    cachedBindVertexArray (vao->VertexArrayID);
+    cachedBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(PackedVertex), vertex_buffer_data, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(PackedVertex), (void*)(4*sizeof(GLshort)));
+
+    // The element buffer binding is part of the VAO
+    glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, numIndices*sizeof(GLubyte), index_buffer_data, GL_STATIC_DRAW);
+
+    return vao;
 }
 
 /* Render the VBOs handled by VAO */
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+    cachedPolygonMode (vao->FillMode);
     
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    // Bind the VAO to use; it already holds the enabled attributes and their VBOs
+    cachedBindVertexArray (vao->VertexArrayID);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+    // Draw the geometry !
+    if(vao->NumIndices)
+        glDrawElements(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_BYTE, (void*)0);
+    else
+        glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+    glstate.draws++;
+}
 
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
-    //glPolygonMode (GL_FRONT_AND_BACK, GL_LINE);
+//Objects queued for flush3DObjects, drawn sorted by fill mode and VAO
+typedef struct DrawItem {
+    VAO* object;
+    glm::mat4 model;
+} DrawItem;
 
-    // Draw the geometry !
-    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
-   // glPolygonMode (GL_FRONT_AND_BACK, GL_LINE);
-    
+vector<DrawItem> drawqueue;
 
+bool drawitemless (const DrawItem& a, const DrawItem& b)
+{
+    if(a.object->FillMode != b.object->FillMode)
+        return a.object->FillMode < b.object->FillMode;
+    return a.object->VertexArrayID < b.object->VertexArrayID;
+}
 
+void submit3DObject (struct VAO* vao, const glm::mat4& model)
+{
+    DrawItem item = { vao, model };
+    drawqueue.push_back(item);
 }
 
-/**************************
- * Customizable functions *
- **************************/
+/* Render numInstances copies of the VAO in a single draw call */
+void drawInstanced3DObject (struct VAO* vao, int numInstances)
+{
+    cachedPolygonMode (vao->FillMode);
 
-float triangle_rot_dir = 1;
-float rectangle_rot_dir = 1;
-bool triangle_rot_status = true;
-bool rectangle_rot_status = true;
+    // The VAO already carries the per-instance attribute setup
+    cachedBindVertexArray (vao->VertexArrayID);
 
-void mousescroll(GLFWwindow *window, double xoffset, double yoffset)
-{
-    camera_zoom += yoffset / 10;
+    if(vao->NumIndices)
+        glDrawElementsInstanced(vao->PrimitiveMode, vao->NumIndices, GL_UNSIGNED_BYTE, (void*)0, numInstances);
+    else
+        glDrawArraysInstanced(vao->PrimitiveMode, 0, vao->NumVertices, numInstances);
+    glstate.draws++;
 }
 
+/* Render several vertex ranges of the VAO in a single draw call */
+void drawranges3DObject (struct VAO* vao, const vector<GLint>& firsts, const vector<GLsizei>& counts)
+{
+    if(firsts.empty())
+        return;
 
+    cachedPolygonMode (vao->FillMode);
+    cachedBindVertexArray (vao->VertexArrayID);
+    glMultiDrawArrays(vao->PrimitiveMode, &firsts[0], &counts[0], firsts.size());
+    glstate.draws++;
+}
 
- void translatetiles(float x, float y , float z, int i, int j)
-  {
-        tiles[i][j].translate_matrix = glm::translate(glm::vec3(x, y, z));
-  }
+//STREAMING BUFFER
+//Per-frame dynamic data (model matrices) is appended to one uniform buffer
+//split into STREAM_FRAMES segments and written through unsynchronised mapped
+//ranges. A fence guards each segment, so the CPU only waits when the GPU is
+//a whole ring behind. A frame that outgrows its segment orphans the buffer.
+#define STREAM_FRAMES 3
+#define STREAM_SEGMENT_SLOTS 512
+
+//Uniform buffer binding point of the per-object "Model" block
+#define MODEL_BINDING 1
+
+struct StreamBuffer {
+    GLObject buffer;
+    GLsizeiptr slot;    //Bytes per matrix, rounded up to the offset alignment
+    GLsizeiptr segment; //Bytes per frame
+    GLintptr head;      //Next free byte
+    int frame;          //Segment being written
+    GLsync fences[STREAM_FRAMES];
+    GLint generation;   //Bumped by orphaning, which drops every slot written so far
+    GLint orphans, waits;
+} stream;
+
+void createStreamBuffer ()
+{
+    GLint align;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    stream.slot = ((sizeof(glm::mat4) + align - 1)/align)*align;
+    stream.segment = STREAM_SEGMENT_SLOTS*stream.slot;
+    stream.head = 0;
+    stream.frame = 0;
+
+    stream.buffer = GLObject(GLK_BUFFER);
+    cachedBindBuffer (GL_UNIFORM_BUFFER, stream.buffer);
+    glBufferData (GL_UNIFORM_BUFFER, STREAM_FRAMES*stream.segment, NULL, GL_STREAM_DRAW);
+}
 
-  void blocktranslate (float x, float y,float  z)
-  {
-    Blockobj.translate_matrix = glm::translate(glm::vec3(x, y, z));
+//Copy count (at most STREAM_SEGMENT_SLOTS) matrices into consecutive slots and return the offset of the first
+GLintptr streammatrices (const glm::mat4* matrices, int count)
+{
+    GLsizeiptr bytes = count*stream.slot;
+    cachedBindBuffer (GL_UNIFORM_BUFFER, stream.buffer);
+    if(stream.head + bytes > (stream.frame + 1)*stream.segment)
+    {
+        // Draws already issued keep the old storage, so nothing needs to wait
+        glBufferData (GL_UNIFORM_BUFFER, STREAM_FRAMES*stream.segment, NULL, GL_STREAM_DRAW);
+        for(int k = 0; k < STREAM_FRAMES; k++)
+        {
+            if(stream.fences[k])
+                glDeleteSync(stream.fences[k]);
+            stream.fences[k] = 0;
+        }
+        stream.frame = 0;
+        stream.head = 0;
+        stream.generation++;
+        stream.orphans++;
+    }
 
-  }
+    char* dst = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, stream.head, bytes,
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    for(int k = 0; k < count; k++)
+        memcpy(dst + k*stream.slot, &matrices[k][0][0], sizeof(glm::mat4));
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
 
+    GLintptr offset = stream.head;
+    stream.head += bytes;
+    return offset;
+}
 
-  void rendertiles(int i, int  j)
-  {
-      glm::mat4 VP = Matrices.projectionP * Matrices.view;
-      glm::mat4 MVP;
-      Matrices.model = glm::mat4(1.0f);
-      Matrices.model = tiles[i][j].translate_matrix;
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(tiles[i][j].object);
-      return;
-  }
+//Point the uniform block at binding to the matrix stored at offset
+void bindstreamslot (GLuint binding, GLintptr offset)
+{
+    glBindBufferRange(GL_UNIFORM_BUFFER, binding, stream.buffer, offset, sizeof(glm::mat4));
+    // Also sets the generic binding
+    glstate.uniformbuffer = stream.buffer;
+    glstate.issued++;
+}
 
-    void blockrotator(float rotation, glm::vec3 rotating_vector=glm::vec3(0,0,1))
-  {
-      Blockobj.rotate_matrix = glm::rotate((float)(rotation*M_PI/180.0f), rotating_vector);
-  }
+//Fence the segment written this frame and move to the next, waiting only if
+//the GPU is still reading it
+void streamendframe ()
+{
+    if(stream.fences[stream.frame])
+        glDeleteSync(stream.fences[stream.frame]);
+    stream.fences[stream.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    stream.frame = (stream.frame + 1) % STREAM_FRAMES;
+    stream.head = stream.frame*stream.segment;
+    GLsync fence = stream.fences[stream.frame];
+    if(fence && glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED)
+    {
+        stream.waits++;
+        while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+    }
+}
 
-  void renderblock()
-  {
+//FRAME SCENE
+//Matrices shared by the draws of a view: the model matrices preparescene
+//sets once per frame and the view's VP, streamed together as each view starts
+enum FrameSlot { FRAME_IDENTITY, FRAME_BLOCK, FRAME_CAMERA, FRAME_SLOTS };
 
-      
-      blocktranslate (Blockobj.x, Blockobj.y, Blockobj.z);
-    
+struct FrameScene {
+    glm::mat4 models[FRAME_SLOTS];
+    GLintptr offset;
+    GLint generation;
+} framescene;
 
-      glm::mat4 MVP;
-      Matrices.model =glm::mat4(1.0f);
-      glm::mat4 VP = Matrices.projectionP * Matrices.view;
-      Matrices.model = Blockobj.translate_matrix*Blockobj.rotate_matrix;
-      MVP = VP * Matrices.model;
-      glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-      draw3DObject(Blockobj.object);
+//Stream the shared matrices and point the "Camera" block at this view's VP
+void streamframescene ()
+{
+    framescene.offset = streammatrices(framescene.models, FRAME_SLOTS);
+    framescene.generation = stream.generation;
+    bindstreamslot(CAMERA_BINDING, framescene.offset + FRAME_CAMERA*stream.slot);
+}
 
-  }
+//Stream offset of a shared matrix, streamed again (camera too) if orphaning dropped it
+GLintptr framesceneslot (FrameSlot k)
+{
+    if(framescene.generation != stream.generation)
+        streamframescene();
+    return framescene.offset + k*stream.slot;
+}
 
+// Fills the 36 triangle vertices of an l x b x h box with one corner at the origin
+void boxvertices(float l, float b, float h, GLfloat vertex_buffer_data[108])
+{
+    const GLfloat box[ ] = {
+        0, 0, 0, b, 0, 0, b, h, 0, b, h, 0, 0, h, 0, 0, 0 , 0,        //1
+        0, 0, 0, 0, h, 0, 0, h, l, 0, h, l, 0, 0, l, 0, 0, 0,    //2
+        0, 0, 0, 0, 0, l, b, 0, l, b, 0, l, b, 0, 0, 0, 0, 0,        //3 
 
-  int level1[6][10] = {
-        {1,1,1,0,0,0,0,0,0,0},
-        {1,1,1,1,1,0,0,0,0,0},
-        {1,1,1,3,1,1,1,1,1,0},
-        {0,1,1,1,1,1,1,1,1,1},
-        {0,0,0,0,0,1,1,4,3,1},
-        {0,0,0,0,0,0,1,1,1,0}
-           };
-
-   int level2[6][15] = {
-        {0,0,0,0,0,0,1,1,1,1,1,1,1,0,0},
-        {1,1,1,1,0,0,1,1,1,0,0,1,1,0,0},
-        {1,1,1,3,1,1,1,1,1,0,0,1,1,1,1},
-        {1,1,1,1,0,0,0,0,0,0,0,1,3,4,1},
-        {1,1,1,1,0,0,0,0,0,0,0,1,1,1,1},
-        {1,1,1,1,0,0,0,0,0,0,0,0,1,1,1}
-
-   };
-
- 
-   int level3[6][15] = {
-        {0,0,0,0,0,0,1,1,1,1,0,0,1,1,1},
-        {1,1,1,1,0,0,1,1,1,1,0,0,1,4,1},
-        {1,1,1,1,0,0,1,1,1,1,0,0,1,1,1},
-        {1,1,1,1,0,0,1,1,1,1,0,0,1,1,1},
-        {1,1,1,1,0,0,1,1,1,1,0,0,1,1,1},
-        {1,1,1,1,0,0,1,1,1,1,0,0,0,0,0},
-
-   };
-void drawtiles ( int a, int b , string s )
-{
-    if(s=="level1")
-    {
-    for(int i = 0; i < a  ; i++ ){
-        for(int j = 0; j < b  ; j++ ){            
-                translatetiles (tiles[i][j].x, tiles[i][j].y, tiles[i][j].z, i, j);   
-                if(level1[i][j]==1 || level1[i][j]==3)
-                    rendertiles(i,j);
-        }
-    }
-    return;
+        0, 0, l, b, 0, l, b, h, l, b, h, l, 0, h, l, 0, 0, l,        //4
+        b, 0, l, b, 0, 0, b, h, 0, b, h, 0, b, h, l, b, 0, l,            //5
+        0, h, l, b, h, l, b, h, 0, b, h, 0, 0, h, 0, 0, h, l         //6
+    };
+    for(int k = 0; k < 108; k++)
+        vertex_buffer_data[k] = box[k];
+}
+
+GLubyte packcolour(float c)
+{
+    return (GLubyte)lround(max(0.0f, min(c, 1.0f))*255.0f);
+}
+
+GLshort packposition(float v)
+{
+    return (GLshort)lround(max(-1.0f, min(v, 1.0f))*32767.0f);
+}
+
+// Indexed l x b x h box. colours holds one rgb per vertex of the 36-vertex
+// boxvertices() layout; corners that agree in position and colour are shared,
+// so a single-coloured box needs only 8 vertices. Returns the vertex count.
+int boxmesh(float l, float b, float h, const GLfloat colours[108], PackedVertex vertices[36], GLubyte indices[36])
+{
+    GLfloat box[108];
+    boxvertices(l, b, h, box);
+
+    int numvertices = 0;
+    for(int k = 0; k < 36; k++)
+    {
+        PackedVertex pv = { packposition(box[3*k]), packposition(box[3*k + 1]), packposition(box[3*k + 2]), 0,
+                            packcolour(colours[3*k]), packcolour(colours[3*k + 1]), packcolour(colours[3*k + 2]), 255 };
+        int v = 0;
+        while(v < numvertices && memcmp(&vertices[v], &pv, sizeof(PackedVertex)))
+            v++;
+        if(v == numvertices)
+            vertices[numvertices++] = pv;
+        indices[k] = v;
+    }
+    return numvertices;
+}
+
+/**************************
+ * Customizable functions *
+ **************************/
+
+float triangle_rot_dir = 1;
+float rectangle_rot_dir = 1;
+bool triangle_rot_status = true;
+bool rectangle_rot_status = true;
+
+void mousescroll(GLFWwindow *window, double xoffset, double yoffset)
+{
+    camera_zoom += yoffset / 10;
+}
+
+
+
+  //Return the model matrix of obj, rebuilding it only if x/y/z moved or the rotation changed
+  const glm::mat4& updatetransform(Base& obj)
+  {
+      if(obj.transform.dirty || obj.x!=obj.transform.x || obj.y!=obj.transform.y || obj.z!=obj.transform.z)
+      {
+          obj.translate_matrix = glm::translate(glm::vec3(obj.x, obj.y, obj.z));
+          obj.transform.model = obj.translate_matrix*obj.rotate_matrix;
+          obj.transform.x = obj.x;
+          obj.transform.y = obj.y;
+          obj.transform.z = obj.z;
+          obj.transform.dirty = 0;
+      }
+      return obj.transform.model;
+  }
+
+
+  //Draw everything queued by submit3DObject, grouped so state changes only between groups
+  void flush3DObjects()
+  {
+      stable_sort(drawqueue.begin(), drawqueue.end(), drawitemless);
+
+      // Stream the model matrices once, then each draw only picks its slot.
+      // Batches leave room to re-stream the view's shared slots after an orphan.
+      vector<glm::mat4> models(drawqueue.size());
+      for(size_t k = 0; k < drawqueue.size(); k++)
+          models[k] = drawqueue[k].model;
+      for(size_t first = 0; first < drawqueue.size(); first += STREAM_SEGMENT_SLOTS - FRAME_SLOTS)
+      {
+          int count = min(drawqueue.size() - first, (size_t)(STREAM_SEGMENT_SLOTS - FRAME_SLOTS));
+          GLintptr offset = streammatrices(&models[first], count);
+          if(framescene.generation != stream.generation)
+              streamframescene();
+          for(int k = 0; k < count; k++)
+          {
+              bindstreamslot(MODEL_BINDING, offset + k*stream.slot);
+              draw3DObject(drawqueue[first + k].object);
+          }
+      }
+      drawqueue.clear();
+  }
+
+    void blockrotator(float rotation, glm::vec3 rotating_vector=glm::vec3(0,0,1))
+  {
+      Blockobj.rotate_matrix = glm::rotate((float)(rotation*M_PI/180.0f), rotating_vector);
+      Blockobj.transform.dirty = 1;
+  }
+
+
+//LEVELS
+//A level file is a LevelHeader, then rows*cols tile bytes in row-major
+//order, then the LevelSwitch records and the LevelCell list they index.
+//The file is read whole and the board points into it, so nothing is parsed
+//per tile. Files live in LEVEL_DIR as level<n>.lvl, numbered from 1.
+#define LEVEL_DIR "levels"
+
+enum TileType { TILE_EMPTY = 0, TILE_FLOOR = 1, TILE_FRAGILE = 3, TILE_GOAL = 4, TILE_SWITCH = 5 };
+
+typedef struct LevelHeader {
+    char magic[4];              //"LVL1"
+    GLubyte rows, cols;
+    GLubyte spawni, spawnj;
+    GLubyte goali, goalj;
+    GLubyte numswitches, numcells;
+    GLfloat topeye[3];          //Top camera, looking from topeye at toptarget
+    GLfloat toptarget[3];
+} LevelHeader;
+
+typedef struct LevelCell {
+    GLubyte i, j;
+} LevelCell;
+
+//Standing on [i][j] turns its cells into floor
+typedef struct LevelSwitch {
+    GLubyte i, j;
+    GLubyte firstcell, numcells;    //Range of the board's LevelCell list
+} LevelSwitch;
+
+struct Board {
+    vector<char> file;
+    LevelHeader* header;
+    GLubyte* cells;
+    LevelSwitch* switches;
+    LevelCell* switchcells;
+    int generation;     //Bumped per load, so the tile caches rebuild
+} board;
+
+string levelpath (int n, const string& dir = LEVEL_DIR)
+{
+    return dir + "/level" + to_string(n) + ".lvl";
+}
+
+bool levelexists (int n)
+{
+    struct stat st;
+    return stat(levelpath(n).c_str(), &st) == 0;
+}
+
+//Bytes of the level file that starts with header h
+size_t levelsize (const LevelHeader* h)
+{
+    return sizeof(LevelHeader) + h->rows*h->cols + h->numswitches*sizeof(LevelSwitch) + h->numcells*sizeof(LevelCell);
+}
+
+/* Check the level file in file, at least a header long, is consistent and
+   make level point into it, taking the file over. On failure level is left
+   as it was. */
+bool parselevel (vector<char>& file, Board& level, const string& name)
+{
+    LevelHeader* h = (LevelHeader*)&file[0];
+    size_t tiles = h->rows*h->cols;
+    bool valid = !memcmp(h->magic, "LVL1", 4) && h->rows && h->cols && file.size() == levelsize(h)
+                 && h->spawni < h->rows && h->spawnj < h->cols && h->goali < h->rows && h->goalj < h->cols;
+    GLubyte* cells = (GLubyte*)&file[sizeof(LevelHeader)];
+    LevelSwitch* switches = (LevelSwitch*)(cells + tiles);
+    LevelCell* switchcells = (LevelCell*)(switches + h->numswitches);
+    //The block spawns standing, so its cell must hold it up
+    valid = valid && cells[h->goali*h->cols + h->goalj] == TILE_GOAL
+                  && (cells[h->spawni*h->cols + h->spawnj] == TILE_FLOOR || cells[h->spawni*h->cols + h->spawnj] == TILE_SWITCH);
+    for(int k = 0; valid && k < h->numswitches; k++)
+        valid = switches[k].i < h->rows && switches[k].j < h->cols && switches[k].firstcell + switches[k].numcells <= h->numcells;
+    for(int k = 0; valid && k < h->numcells; k++)
+        valid = switchcells[k].i < h->rows && switchcells[k].j < h->cols;
+    if(!valid)
+    {
+        fprintf(stderr, "Level: %s is not a valid level file\n", name.c_str());
+        return false;
+    }
+
+    level.file.swap(file);
+    level.header = (LevelHeader*)&level.file[0];
+    level.cells = (GLubyte*)&level.file[sizeof(LevelHeader)];
+    level.switches = (LevelSwitch*)(level.cells + tiles);
+    level.switchcells = (LevelCell*)(level.switches + level.header->numswitches);
+    return true;
+}
+
+/* Read the level file at path into level with a single read. On failure
+   level is left as it was. */
+bool loadlevel (const string& path, Board& level)
+{
+    struct stat st;
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if(stat(path.c_str(), &st) || !in || st.st_size < (off_t)sizeof(LevelHeader))
+    {
+        fprintf(stderr, "Level: could not read %s\n", path.c_str());
+        return false;
     }
-     if(s=="level2")
+    vector<char> file(st.st_size);
+    if(!in.read(&file[0], file.size()))
     {
-    for(int i = 0; i < a  ; i++ ){
-        for(int j = 0; j < b  ; j++ ){            
-                translatetiles (tiles[i][j].x, tiles[i][j].y, tiles[i][j].z, i, j);   
-                if(level2[i][j]==1 || level2[i][j]==3)
-                    rendertiles(i,j);
+        fprintf(stderr, "Level: could not read %s\n", path.c_str());
+        return false;
+    }
+    return parselevel(file, level, path);
+}
+
+/* Write the file of level to path */
+bool savelevel (const string& path, const Board& level)
+{
+    std::ofstream out(path.c_str(), std::ios::out | std::ios::binary);
+    if(!out.write(&level.file[0], level.file.size()))
+    {
+        fprintf(stderr, "Level: could not write %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Read level n into the board */
+bool readlevel (int n)
+{
+    if(!loadlevel(levelpath(n), board))
+        return false;
+    board.generation++;
+    return true;
+}
+
+//Tile type of cell [i][j] of the board, empty off the board
+int leveltile (int i, int j)
+{
+    if(i < 0 || j < 0 || i >= board.header->rows || j >= board.header->cols)
+        return TILE_EMPTY;
+    return board.cells[i*board.header->cols + j];
+}
+
+//Tiles the block can stand on, the ones that are drawn
+bool solidtile (int t)
+{
+    return t == TILE_FLOOR || t == TILE_FRAGILE || t == TILE_SWITCH;
+}
+
+//Whether a block in orientation o stays up with tile t under its tracked cell
+bool supports (int t, Orientation o)
+{
+    return t != TILE_EMPTY && !(o == STANDING && t == TILE_FRAGILE);
+}
+
+//TILES
+//A tile is nothing but its type byte on the board: its box follows from its
+//cell and its colour from its type, so the hot loops only read board.cells
+#define TILE_SIZE 0.3f
+#define TILE_TOP 1.0f
+#define TILE_DEPTH -0.1f    //Tiles hang below TILE_TOP
+
+enum TileColour { COLOUR_LIGHT, COLOUR_DARK, COLOUR_FRAGILE, COLOUR_SWITCH, TILE_COLOURS };
+
+const COLOR tilepalette[TILE_COLOURS] = {
+    { 238.0/256.0, 47.0/256.0, 127.0/256.0 },
+    { 59.0/256.0, 28.0/256.0, 180.0/256.0 },
+    { 100.0/256.0, 117.0/256.0, 167.0/256.0 },
+    { 200.0/256.0, 147.0/256.0, 27.0/256.0 }
+};
+
+//Shared box of each colour, drawn per tile by the immediate path
+VAO* tilemeshes[TILE_COLOURS];
+
+//Floor tiles are chequered; special tiles have their own colour
+int tilecolour (int i, int j)
+{
+    int t = board.cells[i*board.header->cols + j];
+    if(t == TILE_FRAGILE)
+        return COLOUR_FRAGILE;
+    if(t == TILE_SWITCH)
+        return COLOUR_SWITCH;
+    return (i + j) % 2 ? COLOUR_DARK : COLOUR_LIGHT;
+}
+
+//Top corner of the tile of cell [i][j]
+glm::vec3 tileorigin (int i, int j)
+{
+    return glm::vec3(j*TILE_SIZE, TILE_TOP, i*TILE_SIZE);
+}
+
+void rendertiles(int i, int  j)
+{
+    submit3DObject(tilemeshes[tilecolour(i, j)], glm::translate(tileorigin(i, j)));
+}
+
+//SPATIAL GRID
+//Cells are grouped into CHUNK x CHUNK chunks, each with the world-space
+//bounds of its visible tiles, so culling works per chunk instead of per tile
+#define CHUNK 8
+
+typedef struct TileChunk {
+    glm::vec3 lo, hi;
+    int numtiles;      //Visible tiles; empty chunks are never drawn
+    int firstinstance; //Start of the chunk in the instanced path's stream
+} TileChunk;
+
+struct ChunkGrid {
+    int rows, cols;           //Level size in cells
+    int chunkrows, chunkcols;
+    int generation;           //Board generation it was built for, 0 before any
+    vector<TileChunk> chunks;
+    vector<int> visible;      //Chunks that passed the last frustum test
+} chunkgrid;
+
+bool cull_tiles = true;
+
+//Recompute the bounds of chunk c from the current level
+void boundchunk (int c)
+{
+    TileChunk& chunk = chunkgrid.chunks[c];
+    int ci = c / chunkgrid.chunkcols, cj = c % chunkgrid.chunkcols;
+    chunk.numtiles = 0;
+    for(int i = ci*CHUNK; i < min((ci+1)*CHUNK, chunkgrid.rows); i++ ){
+        for(int j = cj*CHUNK; j < min((cj+1)*CHUNK, chunkgrid.cols); j++ ){
+            if(!solidtile(leveltile(i, j)))
+                continue;
+
+            glm::vec3 o = tileorigin(i, j);
+            glm::vec3 lo (o.x, o.y + TILE_DEPTH, o.z);
+            glm::vec3 hi (o.x + TILE_SIZE, o.y, o.z + TILE_SIZE);
+            chunk.lo = chunk.numtiles ? glm::min(chunk.lo, lo) : lo;
+            chunk.hi = chunk.numtiles ? glm::max(chunk.hi, hi) : hi;
+            chunk.numtiles++;
         }
     }
+}
+
+void buildchunks ( int a, int b, int generation )
+{
+    chunkgrid.rows = a;
+    chunkgrid.cols = b;
+    chunkgrid.chunkrows = (a + CHUNK - 1) / CHUNK;
+    chunkgrid.chunkcols = (b + CHUNK - 1) / CHUNK;
+    chunkgrid.generation = generation;
+    chunkgrid.chunks.assign(chunkgrid.chunkrows*chunkgrid.chunkcols, TileChunk());
+    for(size_t c = 0; c < chunkgrid.chunks.size(); c++)
+        boundchunk(c);
+}
+
+//Collect the non-empty chunks whose bounds intersect the frustum of VP
+void cullchunks (const glm::mat4& VP)
+{
+    // Frustum planes straight from the rows of VP (left, right, bottom, top, near, far)
+    glm::vec4 planes[6];
+    for(int k = 0; k < 3; k++)
+    {
+        glm::vec4 row (VP[0][k], VP[1][k], VP[2][k], VP[3][k]);
+        glm::vec4 w (VP[0][3], VP[1][3], VP[2][3], VP[3][3]);
+        planes[2*k] = w + row;
+        planes[2*k + 1] = w - row;
+    }
+
+    chunkgrid.visible.clear();
+    for(size_t c = 0; c < chunkgrid.chunks.size(); c++)
+    {
+        const TileChunk& chunk = chunkgrid.chunks[c];
+        if(!chunk.numtiles)
+            continue;
+
+        bool inside = true;
+        for(int k = 0; k < 6 && inside && cull_tiles; k++)
+        {
+            // Test the box corner furthest along the plane normal
+            glm::vec3 p (planes[k].x > 0 ? chunk.hi.x : chunk.lo.x,
+                         planes[k].y > 0 ? chunk.hi.y : chunk.lo.y,
+                         planes[k].z > 0 ? chunk.hi.z : chunk.lo.z);
+            inside = planes[k].x*p.x + planes[k].y*p.y + planes[k].z*p.z + planes[k].w >= 0;
+        }
+        if(inside)
+            chunkgrid.visible.push_back(c);
     }
-    if(s=="level3")
+}
+
+//TILE RENDERING PATHS
+#define TILES_IMMEDIATE 0 //One draw call per tile
+#define TILES_INSTANCED 1 //One instanced draw call per level
+#define TILES_BAKED 2     //One draw call over a baked world-space level mesh
+GLint tile_path = TILES_BAKED;
+
+//Per-instance data of the instanced tile path
+typedef struct TileInstance {
+    GLfloat x, y, z;
+    GLubyte r, g, b, a;
+} TileInstance;
+
+//Shared tile mesh plus the instance stream of the level being drawn
+struct TileBatch {
+    VAO* mesh;
+    GLObject InstanceBuffer;
+    int NumInstances;
+    bool dirty;
+    int generation;
+} tilebatch;
+
+//Rebuild the instance stream from the visible tiles of the chunk grid, chunk by chunk
+void buildtileinstances ()
+{
+    vector<TileInstance> instances;
+    instances.reserve(chunkgrid.rows*chunkgrid.cols);
+    for(size_t c = 0; c < chunkgrid.chunks.size(); c++)
     {
-        for(int i = 0; i < a  ; i++ ){
-        for(int j = 0; j < b  ; j++ ){            
-                translatetiles (tiles[i][j].x, tiles[i][j].y, tiles[i][j].z, i, j);   
-                if(level3[i][j]==1 || level3[i][j]==3)
-                    rendertiles(i,j);
+        int ci = c / chunkgrid.chunkcols, cj = c % chunkgrid.chunkcols;
+        chunkgrid.chunks[c].firstinstance = instances.size();
+        for(int i = ci*CHUNK; i < min((ci+1)*CHUNK, chunkgrid.rows); i++ ){
+            for(int j = cj*CHUNK; j < min((cj+1)*CHUNK, chunkgrid.cols); j++ ){
+                if(solidtile(leveltile(i, j)))
+                {
+                    glm::vec3 o = tileorigin(i, j);
+                    const COLOR& c = tilepalette[tilecolour(i, j)];
+                    TileInstance inst = { o.x, o.y, o.z, packcolour(c.r), packcolour(c.g), packcolour(c.b), 255 };
+                    instances.push_back(inst);
+                }
+            }
+        }
+    }
+
+    cachedBindBuffer (GL_ARRAY_BUFFER, tilebatch.InstanceBuffer);
+    glBufferData (GL_ARRAY_BUFFER, instances.size()*sizeof(TileInstance), instances.empty() ? NULL : &instances[0], GL_DYNAMIC_DRAW);
+
+    tilebatch.NumInstances = instances.size();
+    tilebatch.generation = chunkgrid.generation;
+    tilebatch.dirty = false;
+}
+
+//Draw instances [first, first+count) by pointing the per-instance attributes at first
+void drawtileinstances (int first, int count)
+{
+    cachedBindVertexArray (tilebatch.mesh->VertexArrayID);
+    cachedBindBuffer (GL_ARRAY_BUFFER, tilebatch.InstanceBuffer);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TileInstance), (void*)(first*sizeof(TileInstance) + 3*sizeof(GLfloat)));
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)(first*sizeof(TileInstance)));
+    drawInstanced3DObject(tilebatch.mesh, count);
+}
+
+//Interleaved world-space vertex of the baked level mesh
+typedef struct BakedVertex {
+    GLfloat x, y, z;
+    GLubyte r, g, b, a;
+} BakedVertex;
+
+//Every cell that can be drawn, a solid one or a bridge cell a switch may
+//open, owns a slot of 36 vertices at a fixed offset, so a changed tile is
+//patched in place. A closed bridge is baked as degenerate triangles. Slots
+//are laid out chunk by chunk so a visible chunk is one vertex range.
+struct BakedLevel {
+    VAO* object;
+    int generation;
+    vector<GLint> slot;         //Per cell: its slot, -1 for a cell that is never drawn
+    vector<GLint> firstslot;    //Per chunk: its first slot; one more entry ends the last chunk
+    vector< pair<int,int> > changed;
+} bakedlevel;
+
+//Record that tile [i][j] changed colour, position or visibility
+void tilechanged (int i, int j)
+{
+    tilebatch.dirty = true;
+    // Only the baked path drains the list, once per frame
+    if(tile_path == TILES_BAKED)
+        bakedlevel.changed.push_back(make_pair(i, j));
+    if(i >= 0 && j >= 0 && i < chunkgrid.rows && j < chunkgrid.cols)
+        boundchunk((i / CHUNK)*chunkgrid.chunkcols + j / CHUNK);
+}
+
+void bakecell ( int i, int j, BakedVertex vertices[36] )
+{
+    if(!solidtile(leveltile(i, j)))
+    {
+        for(int k = 0; k < 36; k++)
+            vertices[k] = BakedVertex();
+        return;
+    }
+
+    GLfloat box[108];
+    boxvertices(TILE_SIZE, TILE_SIZE, TILE_DEPTH, box);
+    glm::vec3 o = tileorigin(i, j);
+    const COLOR& c = tilepalette[tilecolour(i, j)];
+    for(int k = 0; k < 36; k++)
+    {
+        BakedVertex v = { box[3*k] + o.x, box[3*k + 1] + o.y, box[3*k + 2] + o.z,
+                          packcolour(c.r), packcolour(c.g), packcolour(c.b), 255 };
+        vertices[k] = v;
+    }
+}
+
+//Bake the cells of the chunk grid's level that can be drawn into one vertex buffer
+void bakelevel ()
+{
+    int cols = chunkgrid.cols;
+    bakedlevel.slot.assign(chunkgrid.rows*cols, -1);
+    for(int k = 0; k < board.header->numcells; k++)
+        bakedlevel.slot[board.switchcells[k].i*cols + board.switchcells[k].j] = 0;
+
+    // Number the drawable cells chunk by chunk
+    int slots = 0;
+    bakedlevel.firstslot.resize(chunkgrid.chunks.size() + 1);
+    for(size_t c = 0; c < chunkgrid.chunks.size(); c++)
+    {
+        int ci = c / chunkgrid.chunkcols, cj = c % chunkgrid.chunkcols;
+        bakedlevel.firstslot[c] = slots;
+        for(int i = ci*CHUNK; i < min((ci+1)*CHUNK, chunkgrid.rows); i++ ){
+            for(int j = cj*CHUNK; j < min((cj+1)*CHUNK, cols); j++ ){
+                if(bakedlevel.slot[i*cols + j] == 0 || solidtile(leveltile(i, j)))
+                    bakedlevel.slot[i*cols + j] = slots++;
+            }
         }
     }
+    bakedlevel.firstslot[chunkgrid.chunks.size()] = slots;
+
+    vector<BakedVertex> vertices(slots*36);
+    for(int c = 0; c < chunkgrid.rows*cols; c++)
+        if(bakedlevel.slot[c] >= 0)
+            bakecell(c / cols, c % cols, &vertices[bakedlevel.slot[c]*36]);
+
+    if(!bakedlevel.object)
+    {
+        bakedlevel.object = new struct VAO;
+        bakedlevel.object->PrimitiveMode = GL_TRIANGLES;
+        bakedlevel.object->FillMode = GL_FILL;
+        bakedlevel.object->NumIndices = 0;
+        bakedlevel.object->VertexArrayID = GLObject(GLK_VERTEXARRAY);
+        bakedlevel.object->VertexBuffer = GLObject(GLK_BUFFER);
+
+        cachedBindVertexArray (bakedlevel.object->VertexArrayID);
+        cachedBindBuffer (GL_ARRAY_BUFFER, bakedlevel.object->VertexBuffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(BakedVertex), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BakedVertex), (void*)(3*sizeof(GLfloat)));
+    }
+
+    cachedBindBuffer (GL_ARRAY_BUFFER, bakedlevel.object->VertexBuffer);
+    glBufferData (GL_ARRAY_BUFFER, vertices.size()*sizeof(BakedVertex), vertices.empty() ? NULL : &vertices[0], GL_DYNAMIC_DRAW);
+    bakedlevel.object->NumVertices = vertices.size();
+
+    bakedlevel.generation = chunkgrid.generation;
+    bakedlevel.changed.clear();
+}
+
+//Re-upload only the byte ranges of cells that changed since the last frame
+void patchbakedlevel ()
+{
+    if(bakedlevel.changed.empty())
+        return;
+
+    cachedBindBuffer (GL_ARRAY_BUFFER, bakedlevel.object->VertexBuffer);
+    for(size_t k = 0; k < bakedlevel.changed.size(); k++)
+    {
+        int i = bakedlevel.changed[k].first, j = bakedlevel.changed[k].second;
+        if(i < 0 || j < 0 || i >= chunkgrid.rows || j >= chunkgrid.cols || bakedlevel.slot[i*chunkgrid.cols + j] < 0)
+            continue;
+
+        BakedVertex vertices[36];
+        bakecell(i, j, vertices);
+        glBufferSubData (GL_ARRAY_BUFFER, bakedlevel.slot[i*chunkgrid.cols + j]*sizeof(vertices), sizeof(vertices), vertices);
+    }
+    bakedlevel.changed.clear();
+}
+
+//Per-frame tile work shared by every view: chunk bounds, baked mesh, instance stream
+void preparetiles ( int a, int b , int generation )
+{
+    if(chunkgrid.generation != generation)
+        buildchunks(a, b, generation);
+
+    if(tile_path == TILES_BAKED)
+    {
+        if(bakedlevel.generation != generation)
+            bakelevel();
+        else
+            patchbakedlevel();
+    }
+
+    if(tile_path == TILES_INSTANCED && (tilebatch.dirty || tilebatch.generation != generation))
+        buildtileinstances();
+}
+
+//Cull the prepared tiles against VP and draw what is left
+void drawtiles ( const glm::mat4& VP )
+{
+    PROFILE_ZONE("drawtiles");
+    cullchunks(VP);
+
+    if(tile_path == TILES_BAKED)
+    {
+        // One range per run of neighbouring visible chunks, drawn in a single call
+        vector<GLint> firsts;
+        vector<GLsizei> counts;
+        for(size_t k = 0; k < chunkgrid.visible.size(); k++)
+        {
+            int c = chunkgrid.visible[k];
+            GLint first = bakedlevel.firstslot[c]*36;
+            GLsizei count = (bakedlevel.firstslot[c + 1] - bakedlevel.firstslot[c])*36;
+            if(!firsts.empty() && firsts.back() + counts.back() == first)
+                counts.back() += count;
+            else
+            {
+                firsts.push_back(first);
+                counts.push_back(count);
+            }
+        }
+
+        // The baked mesh is already in world space
+        bindstreamslot(MODEL_BINDING, framesceneslot(FRAME_IDENTITY));
+        drawranges3DObject(bakedlevel.object, firsts, counts);
+        return;
+    }
+
+    if(tile_path == TILES_INSTANCED)
+    {
+        cachedUseProgram(instancedProgramID);
+        int first = 0, count = 0;
+        for(size_t k = 0; k < chunkgrid.visible.size(); k++)
+        {
+            const TileChunk& chunk = chunkgrid.chunks[chunkgrid.visible[k]];
+            if(count && first + count != chunk.firstinstance)
+            {
+                drawtileinstances(first, count);
+                count = 0;
+            }
+            if(!count)
+                first = chunk.firstinstance;
+            count += chunk.numtiles;
+        }
+        if(count)
+            drawtileinstances(first, count);
+        cachedUseProgram(programID);
+        return;
+    }
+
+    for(size_t k = 0; k < chunkgrid.visible.size(); k++)
+    {
+        int ci = chunkgrid.visible[k] / chunkgrid.chunkcols, cj = chunkgrid.visible[k] % chunkgrid.chunkcols;
+        for(int i = ci*CHUNK; i < min((ci+1)*CHUNK, chunkgrid.rows); i++ ){
+            for(int j = cj*CHUNK; j < min((cj+1)*CHUNK, chunkgrid.cols); j++ ){
+                if(solidtile(board.cells[i*chunkgrid.cols + j]))
+                    rendertiles(i,j);
+            }
+        }
     }
+    flush3DObjects();
     return;
 }
 
+//TRIGGERS
+//What a cell does to the block that lands on it: open a switch's bridge,
+//give way under a standing block, or finish the level. Triggers are listed
+//per cell when a level starts, so landing looks only at the triggers under
+//the block's tracked cell, once per move. Between moves the rules only
+//read the outcome.
+enum TriggerKind { TRIGGER_SWITCH, TRIGGER_FRAGILE, TRIGGER_GOAL };
+
+typedef struct Trigger {
+    GLubyte kind;
+    GLubyte sw;     //Board switch a TRIGGER_SWITCH presses
+} Trigger;
+
+struct TriggerTable {
+    vector<GLint> first;        //Per cell: start of its triggers; one more entry ends the last cell
+    vector<Trigger> triggers;
+} triggertable;
+
+//Outcome of the last landing
+bool falling = false;   //Nothing holds the block up
+bool atgoal = false;    //Standing on the goal
+
+/* List the triggers of every cell of the board, cell by cell */
+void buildtriggers ()
+{
+    int cells = board.header->rows*board.header->cols;
+    vector< vector<Trigger> > percell(cells);
+    for(int k = 0; k < board.header->numswitches; k++)
+    {
+        Trigger trigger = { TRIGGER_SWITCH, (GLubyte)k };
+        percell[board.switches[k].i*board.header->cols + board.switches[k].j].push_back(trigger);
+    }
+    for(int c = 0; c < cells; c++)
+    {
+        Trigger trigger = { TRIGGER_FRAGILE, 0 };
+        if(board.cells[c] == TILE_FRAGILE)
+            percell[c].push_back(trigger);
+        trigger.kind = TRIGGER_GOAL;
+        if(board.cells[c] == TILE_GOAL)
+            percell[c].push_back(trigger);
+    }
+
+    triggertable.first.resize(cells + 1);
+    triggertable.triggers.clear();
+    for(int c = 0; c < cells; c++)
+    {
+        triggertable.first[c] = triggertable.triggers.size();
+        triggertable.triggers.insert(triggertable.triggers.end(), percell[c].begin(), percell[c].end());
+    }
+    triggertable.first[cells] = triggertable.triggers.size();
+}
+
+//Lay the bridge of switch k, the cells of it that are still open
+void pressswitch (int k)
+{
+    const LevelSwitch& sw = board.switches[k];
+    for(int c = sw.firstcell; c < sw.firstcell + sw.numcells; c++)
+    {
+        const LevelCell& cell = board.switchcells[c];
+        if(board.cells[cell.i*board.header->cols + cell.j] == TILE_EMPTY)
+        {
+            board.cells[cell.i*board.header->cols + cell.j] = TILE_FLOOR;
+            tilechanged(cell.i, cell.j);
+        }
+    }
+}
+
+/* Apply the cell the block has just landed on, as a roll ends or after a respawn */
+void landblock ()
+{
+    int t = leveltile(Blockobj.i, Blockobj.j);
+    falling = t == TILE_EMPTY;
+    atgoal = false;
+    if(t == TILE_EMPTY)
+        return;
+    int c = Blockobj.i*board.header->cols + Blockobj.j;
+    for(int k = triggertable.first[c]; k < triggertable.first[c + 1]; k++)
+    {
+        const Trigger& trigger = triggertable.triggers[k];
+        if(trigger.kind == TRIGGER_SWITCH)
+            pressswitch(trigger.sw);
+        else if(trigger.kind == TRIGGER_FRAGILE)
+            falling = !supports(TILE_FRAGILE, orientation);
+        else if(trigger.kind == TRIGGER_GOAL)
+            atgoal = orientation == STANDING;
+    }
+}
+
+//BLOCK MOVES
+//Every arrow key move is one lookup in movetable. Offsets are in cells
+//(0.3 units); the block's origin (x, z) sits on its lowest covered cell.
+enum Direction { MOVE_LEFT, MOVE_RIGHT, MOVE_UP, MOVE_DOWN, DIRECTIONS };
+
+typedef struct BlockMove {
+    GLint di, dj;       //Change of the tracked cell
+    GLint dx, dz;       //Change of the origin
+    Orientation next;
+    GLint px, py, pz;   //Edge rolled over, from the origin before the move
+} BlockMove;
+
+const BlockMove movetable[ORIENTATIONS][DIRECTIONS] = {
+    //LEFT                                     RIGHT                                       UP                                          DOWN
+    { { 2, 0, 0, 1, ALONG_I_HIGH, 0, 0, 1 },   { -2, 0, 0, -2, ALONG_I_LOW, 0, 0, 0 },   { 0, -2, -2, 0, ALONG_J_LOW, 0, 0, 0 },   { 0, 2, 1, 0, ALONG_J_HIGH, 1, 0, 0 } },   //STANDING
+    { { 2, 0, 0, 2, STANDING, 0, -1, 2 },      { -1, 0, 0, -1, STANDING, 0, -1, 0 },     { 0, -1, -1, 0, ALONG_I_LOW, 0, -1, 0 },  { 0, 1, 1, 0, ALONG_I_LOW, 1, -1, 0 } },   //ALONG_I_LOW
+    { { 1, 0, 0, 2, STANDING, 0, -1, 2 },      { -2, 0, 0, -1, STANDING, 0, -1, 0 },     { 0, -1, -1, 0, ALONG_I_HIGH, 0, -1, 0 }, { 0, 1, 1, 0, ALONG_I_HIGH, 1, -1, 0 } },  //ALONG_I_HIGH
+    { { 1, 0, 0, 1, ALONG_J_LOW, 0, -1, 1 },   { -1, 0, 0, -1, ALONG_J_LOW, 0, -1, 0 },  { 0, -1, -1, 0, STANDING, 0, -1, 0 },     { 0, 2, 2, 0, STANDING, 2, -1, 0 } },      //ALONG_J_LOW
+    { { 1, 0, 0, 1, ALONG_J_HIGH, 0, -1, 1 },  { -1, 0, 0, -1, ALONG_J_HIGH, 0, -1, 0 }, { 0, -2, -1, 0, STANDING, 0, -1, 0 },     { 0, 1, 2, 0, STANDING, 2, -1, 0 } }       //ALONG_J_HIGH
+};
+
+//World direction of each move
+const glm::vec3 movevector[DIRECTIONS] = { glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(-1, 0, 0), glm::vec3(1, 0, 0) };
+
+//Canonical pose of each orientation: origin height and rotation
+typedef struct BlockPose {
+    GLfloat y;
+    GLfloat angle;
+    glm::vec3 axis;
+} BlockPose;
+
+const BlockPose orientationpose[ORIENTATIONS] = {
+    { 1.0f, 0.0f, glm::vec3(1, 0, 0) },
+    { 1.3f, 90.0f, glm::vec3(1, 0, 0) },
+    { 1.3f, 90.0f, glm::vec3(1, 0, 0) },
+    { 1.3f, 90.0f, glm::vec3(0, 0, -1) },
+    { 1.3f, 90.0f, glm::vec3(0, 0, -1) }
+};
+
+void setorientation (Orientation o)
+{
+    orientation = o;
+    Blockobj.y = orientationpose[o].y;
+    blockrotator(orientationpose[o].angle, orientationpose[o].axis);
+}
+
+/* Apply the game rules for one move. The block takes its new pose at once;
+   the roll section animates the way there and lands it as the roll ends. */
+void moveblock (Direction d)
+{
+    const BlockMove& move = movetable[orientation][d];
+    movecount++;
+    Blockobj.i += move.di;
+    Blockobj.j += move.dj;
+    Blockobj.x += move.dx*0.3f;
+    Blockobj.z += move.dz*0.3f;
+    setorientation(move.next);
+
+    cout << "X is "<< Blockobj.x<< endl;
+    cout << "Y is "<< Blockobj.y<< endl;
+    cout <<"Z is "<< Blockobj.z << endl;
+    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
+}
+
+//SOLVER
+//Breadth-first search over the block's states: tracked cell, orientation and
+//the set of switches pressed so far. Bridges only ever open, so that set fixes
+//the board. Moves follow movetable and supports(); a move that would drop the
+//block is never taken, so a solution costs no lives. Each switch set reached
+//gets its own visited bitset of rows*cols*ORIENTATIONS bits.
+#define SOLVER_SWITCHES 32  //Switch sets are the bits of a GLuint
+
+const char movenames[DIRECTIONS] = { 'L', 'R', 'U', 'D' };
+
+typedef struct SolverNode {
+    GLuint layer;           //Index of the node's switch set
+    GLuint cell;
+    GLubyte orientation;
+    GLubyte move;           //Direction that led here
+    GLint parent;           //Queue index of the previous node, -1 at the spawn
+} SolverNode;
+
+//Search buffers, kept between solves so a solve allocates only when it outgrows them
+struct Solver {
+    vector<GLuint> bridges;     //Per cell: switches that open it
+    vector<GLuint> presses;     //Per cell: switches standing on it
+    map<GLuint, GLuint> layers; //Switch set to layer index
+    vector<GLuint> masks;       //Switch set of each layer
+    vector<GLuint> visited;     //Bitset words, layer after layer
+    size_t layerwords;
+    vector<SolverNode> queue;   //Every node reached, in the order found
+    //Dead end analysis of an exploring solve
+    vector<GLuint> rank;        //Visited bits before each visited word
+    vector<GLint> order;        //Queue index of each visited bit, by rank
+    vector<GLint> firstpred;    //Per node: start of its range of preds
+    vector<GLint> preds;        //Queue indices of the nodes that move onto each node
+    vector<GLubyte> alive;      //Per node: whether the goal can still be reached
+    vector<GLubyte> deadcell;
+    bool explored;              //The last search queued every reachable state
+};
+
+//Tile type of cell [i][j] once the switches of mask have been pressed
+int solvertile (const Board& level, const Solver& s, int i, int j, GLuint mask)
+{
+    if(i < 0 || j < 0 || i >= level.header->rows || j >= level.header->cols)
+        return TILE_EMPTY;
+    int c = i*level.header->cols + j;
+    if(level.cells[c] == TILE_EMPTY && (s.bridges[c] & mask))
+        return TILE_FLOOR;
+    return level.cells[c];
+}
+
+//Layer of switch set mask, added with nothing visited the first time it is reached
+GLuint solverlayer (Solver& s, GLuint mask)
+{
+    map<GLuint, GLuint>::iterator l = s.layers.find(mask);
+    if(l != s.layers.end())
+        return l->second;
+    GLuint layer = s.masks.size();
+    s.layers[mask] = layer;
+    s.masks.push_back(mask);
+    s.visited.resize(s.visited.size() + s.layerwords, 0);
+    return layer;
+}
+
+//Position of a state in the visited bitset
+size_t solverbit (const Solver& s, GLuint layer, int cell, int o)
+{
+    return layer*s.layerwords*32 + cell*ORIENTATIONS + o;
+}
+
+//Queue index of a visited state, from the rank of its bit in the bitset
+GLint& solverindex (Solver& s, size_t bit)
+{
+    return s.order[s.rank[bit/32] + __builtin_popcount(s.visited[bit/32] & ((1u << bit%32) - 1))];
+}
+
+//Queue the state unless it was reached before
+void solvervisit (Solver& s, GLuint layer, int cell, int o, int move, int parent)
+{
+    size_t bit = solverbit(s, layer, cell, o);
+    GLuint& word = s.visited[bit/32];
+    if(word & (1u << bit%32))
+        return;
+    word |= 1u << bit%32;
+    SolverNode node = { layer, (GLuint)cell, (GLubyte)o, (GLubyte)move, parent };
+    s.queue.push_back(node);
+}
+
+//Layer and cell that move d takes node to, false if the block would fall there
+bool solverstep (const Board& level, Solver& s, const SolverNode& node, int d, GLuint& layer, int& cell)
+{
+    int cols = level.header->cols;
+    const BlockMove& move = movetable[node.orientation][d];
+    int ni = node.cell/cols + move.di, nj = node.cell%cols + move.dj;
+    GLuint mask = s.masks[node.layer];
+    if(!supports(solvertile(level, s, ni, nj, mask), move.next))
+        return false;
+    cell = ni*cols + nj;
+    layer = node.layer;
+    if((mask | s.presses[cell]) != mask)
+        layer = solverlayer(s, mask | s.presses[cell]);
+    return true;
+}
+
+/* Set s up to search level: its switch tables and an empty search. Returns
+   false, with nothing queued, if the level has more switches than a switch
+   set holds. */
+bool solverprepare (const Board& level, Solver& s)
+{
+    const LevelHeader* h = level.header;
+    s.queue.clear();
+    s.explored = false;
+    if(h->numswitches > SOLVER_SWITCHES)
+    {
+        fprintf(stderr, "Solver: %d switches, at most %d are supported\n", h->numswitches, SOLVER_SWITCHES);
+        return false;
+    }
+    int cols = h->cols, cells = h->rows*h->cols;
+    s.bridges.assign(cells, 0);
+    s.presses.assign(cells, 0);
+    for(int k = 0; k < h->numswitches; k++)
+    {
+        const LevelSwitch& sw = level.switches[k];
+        s.presses[sw.i*cols + sw.j] |= 1u << k;
+        for(int c = sw.firstcell; c < sw.firstcell + sw.numcells; c++)
+            s.bridges[level.switchcells[c].i*cols + level.switchcells[c].j] |= 1u << k;
+    }
+    s.layerwords = (cells*ORIENTATIONS + 31)/32;
+    return true;
+}
+
+/* Find the fewest moves of a prepared solver from the state with switch set
+   mask, tracked cell and orientation o to standing on the goal. Returns false
+   if the goal cannot be reached. With explore the search goes on past the
+   goal until every reachable state is queued, as solverdeadends needs. */
+bool solvefrom (const Board& level, Solver& s, GLuint mask, int cell, Orientation o, vector<Direction>& moves, bool explore)
+{
+    moves.clear();
+    s.layers.clear();
+    s.masks.clear();
+    s.visited.clear();
+    s.queue.clear();
+
+    int goal = level.header->goali*level.header->cols + level.header->goalj;
+    GLint found = -1;
+    solvervisit(s, solverlayer(s, mask), cell, o, 0, -1);
+    for(size_t q = 0; q < s.queue.size(); q++)
+    {
+        SolverNode node = s.queue[q];
+        if(found < 0 && node.orientation == STANDING && (int)node.cell == goal)
+        {
+            found = q;
+            if(!explore)
+                break;
+        }
+        for(int d = 0; d < DIRECTIONS; d++)
+        {
+            GLuint layer;
+            int cell;
+            if(solverstep(level, s, node, d, layer, cell))
+                solvervisit(s, layer, cell, movetable[node.orientation][d].next, d, q);
+        }
+    }
+    s.explored = explore;
+    if(found < 0)
+        return false;
+    for(GLint n = found; s.queue[n].parent >= 0; n = s.queue[n].parent)
+        moves.push_back((Direction)s.queue[n].move);
+    reverse(moves.begin(), moves.end());
+    return true;
+}
+
+/* Find the fewest moves from the spawn cell to standing on the goal, as the
+   board is now. Returns false if the goal cannot be reached. */
+bool solvelevel (const Board& level, Solver& s, vector<Direction>& moves, bool explore = false)
+{
+    moves.clear();
+    if(!solverprepare(level, s))
+        return false;
+    int spawn = level.header->spawni*level.header->cols + level.header->spawnj;
+    return solvefrom(level, s, s.presses[spawn], spawn, STANDING, moves, explore);
+}
+
+/* After an exploring solve, count the reached states from which the goal can
+   no longer be reached without falling, and the cells those states are on.
+   Runs the moves backwards from the goal over a predecessor list. */
+int solverdeadends (const Board& level, Solver& s, int& deadcells)
+{
+    const LevelHeader* h = level.header;
+    int nodes = s.queue.size(), goal = h->goali*h->cols + h->goalj;
+
+    //Visited bit to queue index, by the rank of the bit in the bitset
+    s.rank.resize(s.visited.size());
+    GLuint ranked = 0;
+    for(size_t w = 0; w < s.visited.size(); w++)
+    {
+        s.rank[w] = ranked;
+        ranked += __builtin_popcount(s.visited[w]);
+    }
+    s.order.resize(nodes);
+    for(int q = 0; q < nodes; q++)
+    {
+        solverindex(s, solverbit(s, s.queue[q].layer, s.queue[q].cell, s.queue[q].orientation)) = q;
+    }
+
+    //Every move between reached states, stored by the state it ends on
+    s.firstpred.assign(nodes + 1, 0);
+    for(int pass = 0; pass < 2; pass++)
+    {
+        //Running sums put each range's end in firstpred; filling moves it back to the start
+        if(pass == 1)
+        {
+            for(int q = 1; q <= nodes; q++)
+                s.firstpred[q] += s.firstpred[q - 1];
+            s.preds.resize(s.firstpred[nodes]);
+        }
+        for(int q = 0; q < nodes; q++)
+            for(int d = 0; d < DIRECTIONS; d++)
+            {
+                GLuint layer;
+                int cell;
+                if(!solverstep(level, s, s.queue[q], d, layer, cell))
+                    continue;
+                GLint to = solverindex(s, solverbit(s, layer, cell, movetable[s.queue[q].orientation][d].next));
+                if(pass == 0)
+                    s.firstpred[to]++;
+                else
+                    s.preds[--s.firstpred[to]] = q;
+            }
+    }
+
+    //Walk back from every goal state; what is never reached is a dead end
+    s.alive.assign(nodes, 0);
+    s.order.clear();
+    for(int q = 0; q < nodes; q++)
+        if(s.queue[q].orientation == STANDING && (int)s.queue[q].cell == goal)
+        {
+            s.alive[q] = 1;
+            s.order.push_back(q);
+        }
+    for(size_t k = 0; k < s.order.size(); k++)
+        for(GLint p = s.firstpred[s.order[k]]; p < s.firstpred[s.order[k] + 1]; p++)
+            if(!s.alive[s.preds[p]])
+            {
+                s.alive[s.preds[p]] = 1;
+                s.order.push_back(s.preds[p]);
+            }
+
+    int dead = 0;
+    deadcells = 0;
+    s.deadcell.assign(h->rows*h->cols, 0);
+    for(int q = 0; q < nodes; q++)
+        if(!s.alive[q])
+        {
+            dead++;
+            deadcells += !s.deadcell[s.queue[q].cell];
+            s.deadcell[s.queue[q].cell] = 1;
+        }
+    return dead;
+}
+
+/* --solve: print the optimal solution of every level in LEVEL_DIR */
+int solvelevels ()
+{
+    Solver s;
+    vector<Direction> moves;
+    int failed = 0;
+    for(int n = 1; levelexists(n); n++)
+    {
+        Board level;
+        if(!loadlevel(levelpath(n), level))
+        {
+            failed++;
+            continue;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool solved = solvelevel(level, s, moves);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if(!solved)
+        {
+            printf("level %d: unsolvable (%.3f ms, %zu states)\n", n, ms, s.queue.size());
+            failed++;
+            continue;
+        }
+        string path;
+        for(size_t k = 0; k < moves.size(); k++)
+            path += movenames[moves[k]];
+        printf("level %d: %zu moves %s (%.3f ms, %zu states)\n", n, moves.size(), path.c_str(), ms, s.queue.size());
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//VALIDATOR
+//--validate <dir or pack> checks a level set on every core: each level is
+//solved, explored to the end and searched for dead ends. A pack is level
+//files back to back. Worker threads take the next level in turn and search it
+//in their own Solver, so search buffers are allocated once per thread and
+//never shared. The JSON report goes to stdout in input order. A level with
+//more switches than the solver handles is reported unsupported, not unsolvable.
+
+//A level to check: a file, or a byte range of the pack
+typedef struct LevelJob {
+    string name;
+    size_t offset, size;
+} LevelJob;
+
+typedef struct LevelReport {
+    bool valid, solvable;
+    string error;       //Why a valid level could not be searched, empty if it was
+    string solution;
+    size_t states;
+    int deadends, deadcells;
+    vector<LevelCell> deadcelllist; //The dead cells, row by row
+    double ms;
+} LevelReport;
+
+/* List the levels of a directory's .lvl files, in name order, or of a pack,
+   which is read whole into pack */
+bool listlevels (const string& path, vector<LevelJob>& jobs, vector<char>& pack)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st))
+    {
+        fprintf(stderr, "Validator: could not read %s\n", path.c_str());
+        return false;
+    }
+    if(S_ISDIR(st.st_mode))
+    {
+        DIR* dir = opendir(path.c_str());
+        if(!dir)
+        {
+            fprintf(stderr, "Validator: could not read %s\n", path.c_str());
+            return false;
+        }
+        for(struct dirent* entry; (entry = readdir(dir)); )
+        {
+            string name = entry->d_name;
+            if(name.size() > 4 && name.compare(name.size() - 4, 4, ".lvl") == 0)
+            {
+                LevelJob job = { path + "/" + name, 0, 0 };
+                jobs.push_back(job);
+            }
+        }
+        closedir(dir);
+        sort(jobs.begin(), jobs.end(), [](const LevelJob& a, const LevelJob& b) { return a.name < b.name; });
+        return true;
+    }
+
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    pack.resize(st.st_size);
+    if(!in || (st.st_size && !in.read(&pack[0], pack.size())))
+    {
+        fprintf(stderr, "Validator: could not read %s\n", path.c_str());
+        return false;
+    }
+    for(size_t offset = 0; offset < pack.size(); )
+    {
+        size_t size = pack.size() - offset < sizeof(LevelHeader) ? 0 : levelsize((LevelHeader*)&pack[offset]);
+        if(!size || size > pack.size() - offset)
+        {
+            fprintf(stderr, "Validator: %s is cut short after %zu levels\n", path.c_str(), jobs.size());
+            return false;
+        }
+        LevelJob job = { path + "#" + to_string(jobs.size() + 1), offset, size };
+        jobs.push_back(job);
+        offset += size;
+    }
+    return true;
+}
+
+//Solve one level and look for its dead ends with the thread's solver
+void validatelevel (const LevelJob& job, const vector<char>& pack, Solver& s, vector<Direction>& moves, LevelReport& report)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Board level;
+    if(pack.empty())
+        report.valid = loadlevel(job.name, level);
+    else
+    {
+        vector<char> file(pack.begin() + job.offset, pack.begin() + job.offset + job.size);
+        report.valid = parselevel(file, level, job.name);
+    }
+    report.solvable = false;
+    report.states = report.deadends = report.deadcells = 0;
+    if(report.valid && level.header->numswitches > SOLVER_SWITCHES)
+        report.error = "unsupported: >" + to_string(SOLVER_SWITCHES) + " switches";
+    else if(report.valid)
+    {
+        report.solvable = solvelevel(level, s, moves, true);
+        for(size_t k = 0; k < moves.size(); k++)
+            report.solution += movenames[moves[k]];
+        report.states = s.queue.size();
+        if(s.explored)
+            report.deadends = solverdeadends(level, s, report.deadcells);
+        for(size_t c = 0; c < s.deadcell.size() && report.deadcells; c++)
+            if(s.deadcell[c])
+            {
+                LevelCell cell = { (GLubyte)(c/level.header->cols), (GLubyte)(c%level.header->cols) };
+                report.deadcelllist.push_back(cell);
+            }
+    }
+    report.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//Text with its quotes and backslashes escaped for a JSON string
+string jsonescape (const string& text)
+{
+    string escaped;
+    for(size_t k = 0; k < text.size(); k++)
+    {
+        if(text[k] == '"' || text[k] == '\\')
+            escaped += '\\';
+        escaped += text[k];
+    }
+    return escaped;
+}
+
+/* --validate: check every level of path on threads workers (0 for one per
+   core) and print the report */
+int validatelevels (const string& path, int threads)
+{
+    vector<LevelJob> jobs;
+    vector<char> pack;
+    if(!listlevels(path, jobs, pack))
+        return EXIT_FAILURE;
+    if(threads <= 0)
+        threads = max(1u, std::thread::hardware_concurrency());
+    threads = min(threads, max(1, (int)jobs.size()));
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<LevelReport> reports(jobs.size());
+    std::atomic<size_t> next(0);
+    vector<std::thread> workers;
+    for(int t = 0; t < threads; t++)
+        workers.push_back(std::thread([&]() {
+            Solver s;
+            vector<Direction> moves;
+            for(size_t k; (k = next++) < jobs.size(); )
+                validatelevel(jobs[k], pack, s, moves, reports[k]);
+        }));
+    for(int t = 0; t < threads; t++)
+        workers[t].join();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    int invalid = 0, unsupported = 0, unsolvable = 0;
+    printf("{\"levels\":[");
+    for(size_t k = 0; k < jobs.size(); k++)
+    {
+        const LevelReport& r = reports[k];
+        printf("%s\n{\"name\":\"%s\",\"valid\":%s", k ? "," : "", jsonescape(jobs[k].name).c_str(), r.valid ? "true" : "false");
+        if(!r.error.empty())
+            printf(",\"error\":\"%s\"", jsonescape(r.error).c_str());
+        else if(r.valid)
+        {
+            printf(",\"solvable\":%s", r.solvable ? "true" : "false");
+            if(r.solvable)
+                printf(",\"moves\":%zu,\"solution\":\"%s\"", r.solution.size(), r.solution.c_str());
+            printf(",\"states\":%zu,\"deadends\":%d,\"deadcells\":%d,\"deadcelllist\":[", r.states, r.deadends, r.deadcells);
+            for(size_t c = 0; c < r.deadcelllist.size(); c++)
+                printf("%s[%d,%d]", c ? "," : "", r.deadcelllist[c].i, r.deadcelllist[c].j);
+            printf("]");
+        }
+        printf(",\"ms\":%.3f}", r.ms);
+        invalid += !r.valid;
+        unsupported += !r.error.empty();
+        unsolvable += r.valid && r.error.empty() && !r.solvable;
+    }
+    printf("\n],\"total\":%zu,\"invalid\":%d,\"unsupported\":%d,\"unsolvable\":%d,\"threads\":%d,\"ms\":%.3f}\n",
+           jobs.size(), invalid, unsupported, unsolvable, threads, ms);
+    fprintf(stderr, "Validator: %zu levels on %d threads in %.1f ms\n", jobs.size(), threads, ms);
+    return invalid || unsupported || unsolvable ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//GENERATOR
+//--generate <count> <dir> writes count solvable levels of --size RxC that take
+//at least --difficulty moves. A candidate is carved along a random walk of the
+//block from the spawn to a goal it ends standing on; the walk mostly turns
+//away from cells it has been on, so its length stays close to the length of
+//the solution. Switches close part of
+//the walk behind a bridge that the walk opens first, and floor the walk never
+//stands on may turn fragile. Decoy floor beside the walk gives the search
+//other ways to go. Every candidate is still solved exactly, and kept only if its
+//optimal solution is long enough, so the walk is only there to make most of
+//them worth solving. Workers write each level as soon as it is accepted.
+#define GENERATOR_SWITCHES 3    //Most switches per level
+#define GENERATOR_BRIDGE 4      //Most cells per bridge
+
+typedef struct GeneratorSettings {
+    int rows, cols;
+    int difficulty;     //Fewest moves of a kept level's optimal solution
+    unsigned seed;      //Worker t draws from seed + t
+    size_t candidates;  //Most candidates tried before giving up
+} GeneratorSettings;
+
+/* Build a random candidate level file into file. Returns false if the walk
+   got stuck, with no move left on the board or no end in sight. */
+bool generatelevel (const GeneratorSettings& g, std::mt19937& rng, vector<char>& file)
+{
+    int rows = g.rows, cols = g.cols;
+    vector<GLubyte> cells(rows*cols, TILE_EMPTY);
+    vector<int> walk;                       //Tracked cell after each step
+    vector<int> firstvisit(rows*cols, -1);  //Step that first reached each cell
+    vector<GLubyte> upright(rows*cols, 0);  //Whether the walk stands on each cell
+
+    //Walk at least twice the difficulty, then on until standing away from the spawn
+    int i = rng()%rows, j = rng()%cols;
+    Orientation o = STANDING;
+    int steps = 2*g.difficulty + rng()%(g.difficulty + 1);
+    walk.push_back(i*cols + j);
+    firstvisit[i*cols + j] = 0;
+    upright[i*cols + j] = 1;
+    while((int)walk.size() <= steps || o != STANDING || walk.back() == walk[0])
+    {
+        bool canmove = false;
+        for(int d = 0; d < DIRECTIONS; d++)
+        {
+            const BlockMove& move = movetable[o][d];
+            canmove |= i + move.di >= 0 && i + move.di < rows && j + move.dj >= 0 && j + move.dj < cols;
+        }
+        if(!canmove || (int)walk.size() > 4*steps + 64)
+            return false;
+        const BlockMove& move = movetable[o][rng()%DIRECTIONS];
+        if(i + move.di < 0 || i + move.di >= rows || j + move.dj < 0 || j + move.dj >= cols)
+            continue;
+        if(firstvisit[(i + move.di)*cols + j + move.dj] >= 0 && rng()%8)
+            continue;
+        i += move.di;
+        j += move.dj;
+        o = move.next;
+        int c = i*cols + j;
+        if(firstvisit[c] < 0)
+            firstvisit[c] = walk.size();
+        upright[c] |= o == STANDING;
+        walk.push_back(c);
+        cells[c] = TILE_FLOOR;
+    }
+    int spawn = walk[0], goal = walk.back();
+
+    for(int c = 0; c < rows*cols; c++)
+    {
+        bool beside = (c >= cols && firstvisit[c - cols] >= 0) || (c + cols < rows*cols && firstvisit[c + cols] >= 0)
+                      || (c%cols > 0 && firstvisit[c - 1] >= 0) || (c%cols < cols - 1 && firstvisit[c + 1] >= 0);
+        if(cells[c] == TILE_EMPTY && beside && rng()%5 == 0)
+            cells[c] = TILE_FLOOR;
+        if(cells[c] == TILE_FLOOR && !upright[c] && rng()%4 == 0)
+            cells[c] = TILE_FRAGILE;
+    }
+    cells[spawn] = TILE_FLOOR;
+    cells[goal] = TILE_GOAL;
+
+    //A switch on the first half of the walk, bridging cells it only reaches later
+    vector<LevelSwitch> switches;
+    vector<LevelCell> switchcells;
+    int numswitches = rng()%(GENERATOR_SWITCHES + 1);
+    for(int k = 0; k < numswitches; k++)
+    {
+        int step = 1 + rng()%(walk.size()/2);
+        int at = walk[step];
+        if(at == goal || cells[at] != TILE_FLOOR)
+            continue;
+        LevelSwitch sw = { (GLubyte)(at/cols), (GLubyte)(at%cols), (GLubyte)switchcells.size(), 0 };
+        for(int w = step + 1 + rng()%(walk.size() - step - 1); w < (int)walk.size() && sw.numcells < GENERATOR_BRIDGE; w++)
+        {
+            int c = walk[w];
+            if(c == goal || firstvisit[c] <= step || (cells[c] != TILE_FLOOR && cells[c] != TILE_FRAGILE))
+                continue;
+            cells[c] = TILE_EMPTY;
+            LevelCell cell = { (GLubyte)(c/cols), (GLubyte)(c%cols) };
+            switchcells.push_back(cell);
+            sw.numcells++;
+        }
+        if(sw.numcells)
+        {
+            cells[at] = TILE_SWITCH;
+            switches.push_back(sw);
+        }
+    }
+
+    LevelHeader h;
+    memcpy(h.magic, "LVL1", 4);
+    h.rows = rows;
+    h.cols = cols;
+    h.spawni = spawn/cols;
+    h.spawnj = spawn%cols;
+    h.goali = goal/cols;
+    h.goalj = goal%cols;
+    h.numswitches = switches.size();
+    h.numcells = switchcells.size();
+    //Top camera above the middle of the board, high enough for its 90 degree
+    //field of view. The view scales the world by the starting zoom first.
+    float zoom = exp(camera_zoom);
+    h.topeye[0] = h.toptarget[0] = cols*TILE_SIZE/2*zoom;
+    h.topeye[1] = (TILE_TOP + 0.6f*max(rows, cols)*TILE_SIZE)*zoom;
+    h.toptarget[1] = 0;
+    h.topeye[2] = h.toptarget[2] = rows*TILE_SIZE/2*zoom;
+
+    file.resize(levelsize(&h));
+    char* out = &file[0];
+    memcpy(out, &h, sizeof(h));
+    out += sizeof(h);
+    memcpy(out, &cells[0], cells.size());
+    out += cells.size();
+    if(!switches.empty())
+        memcpy(out, &switches[0], switches.size()*sizeof(LevelSwitch));
+    out += switches.size()*sizeof(LevelSwitch);
+    if(!switchcells.empty())
+        memcpy(out, &switchcells[0], switchcells.size()*sizeof(LevelCell));
+    return true;
+}
+
+bool generatorsettingsvalid (const GeneratorSettings& g)
+{
+    if(g.rows < 3 || g.cols < 3 || g.rows > 255 || g.cols > 255 || g.difficulty < 1)
+    {
+        fprintf(stderr, "Generator: boards are 3x3 to 255x255 and need a difficulty of at least 1\n");
+        return false;
+    }
+    return true;
+}
+
+/* --generate: write count levels to dir, as level1.lvl up, on threads workers
+   (0 for one per core) */
+int generatelevels (int count, const string& dir, const GeneratorSettings& g, int threads)
+{
+    if(!generatorsettingsvalid(g))
+        return EXIT_FAILURE;
+    mkdir(dir.c_str(), 0755);
+    if(threads <= 0)
+        threads = max(1u, std::thread::hardware_concurrency());
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    std::atomic<int> accepted(0);
+    std::atomic<size_t> candidates(0);
+    std::atomic<bool> failed(false);
+    vector<std::thread> workers;
+    for(int t = 0; t < threads; t++)
+        workers.push_back(std::thread([&, t]() {
+            std::mt19937 rng(g.seed + t);
+            Solver s;
+            vector<Direction> moves;
+            vector<char> file;
+            Board level;
+            while(accepted < count && !failed && candidates < g.candidates)
+            {
+                candidates++;
+                if(!generatelevel(g, rng, file) || !parselevel(file, level, "generated level") || !solvelevel(level, s, moves) || (int)moves.size() < g.difficulty)
+                    continue;
+                int n = ++accepted;
+                if(n > count)
+                    break;
+                if(!savelevel(levelpath(n, dir), level))
+                    failed = true;
+                else
+                    printf("%s: %zu moves\n", levelpath(n, dir).c_str(), moves.size());
+            }
+        }));
+    for(int t = 0; t < threads; t++)
+        workers[t].join();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Generator: %d levels from %zu candidates on %d threads in %.1f ms (%.0f candidates/s)\n",
+            min((int)accepted, count), (size_t)candidates, threads, ms, candidates*1000.0/ms);
+    if(accepted < count)
+    {
+        fprintf(stderr, "Generator: gave up after %zu candidates, try a lower --difficulty, a bigger --size or more --candidates\n", (size_t)candidates);
+        return EXIT_FAILURE;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//ROLL ANIMATION
+//A move updates the block's logical pose at once. The drawn block then tips
+//over the bottom edge it rolls across, driven by simulation time, and lands
+//when the roll ends: switches, fragile tiles and the goal act only then. Keys
+//pressed during a roll wait in a short queue and start as the roll ends.
+#define ROLL_TIME 0.25
+#define ROLL_QUEUE 4    //Presses that can wait; a press on a full queue replaces the last one
+
+struct Roll {
+    bool active;
+    double elapsed;         //Simulated time since the roll started
+    glm::vec3 pivot;        //Point on the edge, relative to the block's position after the move
+    glm::vec3 axis;
+    glm::mat4 spin;         //Symmetry of the box giving its true orientation over the logical pose
+    Direction queued[ROLL_QUEUE];
+    int numqueued;
+} roll = { false, 0, glm::vec3(0), glm::vec3(1, 0, 0), glm::mat4(1.0f), {}, 0 };
+
+glm::vec3 blockposition ()
+{
+    return glm::vec3(Blockobj.x, Blockobj.y, Blockobj.z);
+}
+
+//Turn by angle degrees about the line through pivot along axis
+glm::mat4 pivotrotation (float angle, const glm::vec3& pivot, const glm::vec3& axis)
+{
+    return glm::translate(pivot) * glm::rotate((float)(angle*M_PI/180.0f), axis) * glm::translate(-pivot);
+}
+
+//Snap m to the nearest rotation that maps the block's box onto itself
+glm::mat4 boxsymmetry (const glm::mat4& m)
+{
+    glm::mat4 s(1.0f);
+    for(int c = 0; c < 3; c++)
+        for(int r = 0; r < 3; r++)
+            s[c][r] = roundf(m[c][r]);
+    glm::vec3 centre (Blockobj.width/2, Blockobj.height/2, Blockobj.length/2);
+    s[3] = glm::vec4(centre - glm::mat3(s)*centre, 1);
+    return s;
+}
+
+/* Make the move in direction d and roll the drawn block from where it was. The
+   game only knows the canonical pose of each orientation, so the orientation a
+   real roll ends in is kept in roll.spin to keep the faces continuous from one
+   roll to the next. */
+void startroll (Direction d)
+{
+    glm::mat4 before = updatetransform(Blockobj) * roll.spin;
+    const BlockMove& move = movetable[orientation][d];
+    glm::vec3 pivot = blockposition() + glm::vec3(move.px, move.py, move.pz)*0.3f;
+    // Turn so the top falls towards the move
+    glm::vec3 axis = glm::cross(glm::vec3(0, 1, 0), movevector[d]);
+
+    moveblock(d);
+
+    glm::mat4 after = pivotrotation(90, pivot, axis) * before;
+    roll.spin = boxsymmetry(glm::inverse(updatetransform(Blockobj)) * after);
+    roll.pivot = pivot - blockposition();
+    roll.axis = axis;
+    roll.elapsed = 0;
+    roll.active = true;
+}
+
+//Arrow key handler: roll now, or after the rolls already waiting. The latest
+//press is always kept, so the block ends up where the player pressed last.
+void queueroll (Direction d)
+{
+    if(!roll.active)
+        startroll(d);
+    else if(roll.numqueued < ROLL_QUEUE)
+        roll.queued[roll.numqueued++] = d;
+    else
+        roll.queued[ROLL_QUEUE - 1] = d;
+}
+
+//Advance the roll by one simulation step of dt seconds
+void steproll (double dt)
+{
+    if(!roll.active)
+        return;
+    roll.elapsed += dt;
+    if(roll.elapsed < ROLL_TIME - 1e-9)
+        return;
+    roll.active = false;
+    landblock();
+    // A block that falls or reaches the goal takes no more moves
+    if(falling || atgoal)
+        roll.numqueued = 0;
+    if(roll.numqueued > 0)
+    {
+        Direction d = roll.queued[0];
+        roll.numqueued--;
+        memmove(roll.queued, roll.queued + 1, roll.numqueued*sizeof(Direction));
+        startroll(d);
+    }
+}
+
+//Drawn model of the block whose logical model is given, ahead seconds past the last step
+glm::mat4 rollmodel (const glm::mat4& model, double ahead)
+{
+    glm::mat4 drawn = model * roll.spin;
+    if(!roll.active)
+        return drawn;
+    float t = min(1.0, (roll.elapsed + ahead)/ROLL_TIME);
+    float eased = t*t*(3 - 2*t);
+    return pivotrotation(90*(eased - 1), blockposition() + roll.pivot, roll.axis) * drawn;
+}
+
 /* Executed when a regular key is pressed/released/held-down */
 /* Prefered for Keyboard events */
 void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    PROFILE_ZONE("keyboard");
     // Function is called first on GLFW_PRESS.
 
     if (action == GLFW_RELEASE) {
@@ -512,355 +2862,44 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 
     case GLFW_KEY_T:
 
-                view="top";                        
+                view=VIEW_TOP;
                 
 
     break;
 
     case GLFW_KEY_D:
-                view ="default";
+                view =VIEW_DEFAULT;
                 break;
 
     case GLFW_KEY_B:
-                view="block";
+                view=VIEW_BLOCK;
                 break;
 
     case GLFW_KEY_F:
-                view="followcam";
+                view=VIEW_FOLLOW;
                 break;
     case GLFW_KEY_H:
                 
-                view="helicopter";
+                view=VIEW_HELICOPTER;
+                break;
+    case GLFW_KEY_M:
+                minimap = !minimap;
+                break;
+    case GLFW_KEY_F12:
+                writetrace(trace_path);
                 break;
     case GLFW_KEY_LEFT:
-                count++;
-                if(bstatus == "up")
-                {
-                    Blockobj.z += 0.3f;
-                    Blockobj.y =1.3f;
-
-                    Blockobj.i+=2;
-                    previous="left";
-                    activated="l";
-
-                    
-                   /* */
-                    float rots=0.0f;
-                    while(rots<=90.0f)
-                        {
-                            blockrotator(rots, glm::vec3(1, 0, 0));
-                          
-                            rots+=0.01f;
-                            //sleep(0.1);
-                            renderblock();
-                        }
-                          
-                    cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                   
-                    bstatus="horizdown";
-                }
-               else if (bstatus=="horizdown")
-               {
-                   Blockobj.z += 2*0.3f;
-                  Blockobj.y = 1.0f;
-
-                  //Assign i and j values depending on previous key pressed
-                  if(activated=="l")
-                  {
-                  Blockobj.i+=1;
-
-                  }
-                  else if(activated=="r")
-                  {
-                      Blockobj.i+=2;
-                  }
-                      
-                previous="left";
-                activated="n";
-
-                    blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-
-                    renderblock();
-                     
-                    bstatus="up";
-                    cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                }
-          
-          else if (bstatus=="lateraldown")
-            {
-                Blockobj.z += 0.3f;
-                  Blockobj.y = 1.3f;
-                
-                  if(activated=="u")
-                  {
-                  Blockobj.i+=1;
-                  activated="u";
-
-                  }
-                  else if(activated=="d")
-                  {
-                      Blockobj.i+=1;
-                      activated="d";
-                  }
-                             
-                previous="left";
-                
-
-                   
-                    //blockrotator ( 0.0f, glm::vec3 ( 0,0,-1 ) );
-
-                    renderblock();
-                    cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-             }
+                queueroll(MOVE_LEFT);
+                break;
+    case GLFW_KEY_RIGHT:
+                queueroll(MOVE_RIGHT);
+                break;
+    case GLFW_KEY_UP:
+                queueroll(MOVE_UP);
+                break;
+    case GLFW_KEY_DOWN:
+                queueroll(MOVE_DOWN);
                 break;
-
-     case GLFW_KEY_RIGHT:
-            count++;
-            if(bstatus=="up")
-            {
-                Blockobj.z -= 2*0.3f;
-                Blockobj.y =1.3f;
-                float rots=0.0f;
-
-                Blockobj.i-=2;
-                activated="r";
-
-                  
-                previous="right";
-                    
-                            blockrotator(90.0f, glm::vec3(1, 0, 0));
-                          
-                           
-                //blockrotator(90.0f, glm::vec3(1, 0, 0));
-                
-                cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                bstatus="horizdown";
-                   
-                
-            }
-            else if (bstatus=="horizdown")
-               {
-                  Blockobj.z -= 0.3f;
-                  Blockobj.y = 1.0f;
-                  
-                  if(activated=="l")
-                  {
-                  Blockobj.i-=2;
-                  activated="n";
-
-                  }
-                  else if(activated=="r")
-                  {
-                      Blockobj.i-=1;
-                      activated="n";
-                  }
-                     
-                previous="right";
-
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-
-                    renderblock();
-                     cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                    bstatus="up";
-                    
-                }
-            else if (bstatus=="lateraldown")
-            {
-                Blockobj.z -= 0.3f;
-                  Blockobj.y = 1.3f;
-
-                  if(activated=="u")
-                  {
-                  Blockobj.i-=1;
-                  activated="u";
-
-                  }
-                  else if(activated=="d")
-                  {
-                      Blockobj.i-=1;
-                      activated="d";
-                  }
-                   previous="right";
-                    //blockrotator ( 0.0f, glm::vec3 ( 0,0,-1 ) );
-
-                    renderblock();
-                    cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-             }
-             break;
-
-        case GLFW_KEY_UP:
-            count++;
-            if(bstatus=="up")
-            {
-                Blockobj.x -= 2*0.3f;
-                Blockobj.y =1.3f;
-
-                Blockobj.j-=2;
-                previous="up";
-                activated="u";
-
-
-                blockrotator(90.0f, glm::vec3(0, 0, -1));
-                renderblock();
-                     
-                    bstatus="lateraldown";
-                    cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-            }              
-            else if (bstatus=="lateraldown")
-            {
-                Blockobj.x -= 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-
-                   if(activated=="u")
-                   {
-                       Blockobj.j-=1;
-                       activated="n";
-                   }
-                   else if (activated=="d")
-                   {
-                       Blockobj.j-=2;
-                       activated="n";
-                   }
-                   previous="up";
-
-
-
-
-                    blockrotator ( 0.0f, glm::vec3 ( 0,0,-1 ) );
-
-                    renderblock();
-                    bstatus="up";
-                   cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-
-            }
-             else if(bstatus=="horizdown") 
-            {
-                  Blockobj.x -= 0.3f;
-                  Blockobj.y = 1.3f;
-                  bstatus="horizdown";
-
-                  if(activated=="l")
-                  {
-                      Blockobj.j-=1;
-                      activated="l";
-                  }
-                  else if (activated=="r")
-                  {
-                      Blockobj.j-=1;
-                      activated="r";
-                  }
-
-                  previous="up";
-                    //blockrotator ( 180.0f, glm::vec3 ( 0,0,-1 ) );
-                  renderblock();
-                  cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                     
-            }
-            break;
-
-        case GLFW_KEY_DOWN:
-            count++;
-            if(bstatus=="up")
-            {
-                Blockobj.x += 0.3f;
-                Blockobj.y =1.3f;
-
-                Blockobj.j+=2;
-                previous="down";
-                activated="d";
-
-                blockrotator(-90.0f, glm::vec3(0, 0, 1));
-                renderblock();
-                     
-                    bstatus="lateraldown";
-                      cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-            }              
-            else if (bstatus=="lateraldown")
-            {
-                Blockobj.x += 2*0.3f;
-                  Blockobj.y = 1.0f;
-
-                  if(activated=="u"){
-                      Blockobj.j+=2;
-                      activated="n";
-                  }
-                  else if (activated=="d")
-                  {
-                      Blockobj.j+=1;
-                      activated="n";
-                  }
-                  previous="down";
-
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 0,0,1 ) );
-                    renderblock();
-                    bstatus="up";
-
-                     cout << "haha X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                    cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-            }
-            else if(bstatus=="horizdown")
-            {
-                  Blockobj.x += 0.3f;
-                  Blockobj.y = 1.3f;
-
-                  if(activated=="r")
-                  {
-                      Blockobj.j+=1;
-                      activated="r";
-                  }
-
-                  else if(activated=="l")
-                  {
-                      Blockobj.j+=1;
-                      activated="l";
-                  }
-
-                  previous="down";
-                   // blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-                  renderblock();
-                 cout << "X is "<< Blockobj.x<< endl;
-                    cout << "Y is "<< Blockobj.y<< endl;
-                    cout <<"Z is "<< Blockobj.z << endl;
-                cout << "COORDS ARE : " << "[" << Blockobj.i << "][" << Blockobj.j << "]" << endl;
-                     
-            }
-            break;
-                
 	case GLFW_KEY_ESCAPE:
 	    quit(window);
 	    break;
@@ -873,6 +2912,7 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
 /* Executed for character input (like in text boxes) */
 void keyboardChar (GLFWwindow* window, unsigned int key)
 {
+    PROFILE_ZONE("keyboardChar");
     switch (key) {
     case 'Q':
     case 'q':
@@ -925,6 +2965,7 @@ void keyboardChar (GLFWwindow* window, unsigned int key)
 /* Executed when a mouse button is pressed/released */
 void mouseButton (GLFWwindow* window, int button, int action, int mods)
 {
+    PROFILE_ZONE("mouseButton");
     switch (button) {
     case GLFW_MOUSE_BUTTON_LEFT:
 	if (action == GLFW_RELEASE)
@@ -935,7 +2976,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
     else if(action == GLFW_PRESS)
     {
             mousepress=1;
-            view="helicopter";
+            view=VIEW_HELICOPTER;
     }
 	break;
 
@@ -955,7 +2996,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
 void reshapeWindow (GLFWwindow* window, int width, int height)
 {
     int fbwidth=width, fbheight=height;
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    getframebuffersize(window, &fbwidth, &fbheight);
 
     GLfloat fov = M_PI/2.0f;
 
@@ -996,63 +3037,77 @@ void createTriangle ()
 
 
 
-void createBox(float l, float b, float h, float r, float g, float bl, float x, float y , float z,int i, int j)
+//MESH REGISTRY
+//Boxes with the same dimensions and colour share one VAO, counted by reference
+typedef struct MeshKey {
+    GLfloat l, b, h;
+    GLfloat r, g, bl;
+
+    bool operator< (const MeshKey& o) const
+    {
+        if(l!=o.l) return l<o.l;
+        if(b!=o.b) return b<o.b;
+        if(h!=o.h) return h<o.h;
+        if(r!=o.r) return r<o.r;
+        if(g!=o.g) return g<o.g;
+        return bl<o.bl;
+    }
+} MeshKey;
+
+typedef struct MeshEntry {
+    VAO* object;
+    int refs;
+} MeshEntry;
+
+map<MeshKey, MeshEntry> meshes;
+map<VAO*, MeshKey> meshkeys;
+
+/* Hand out the shared VAO for a box, creating it on first use */
+VAO* acquireBoxMesh(float l, float b, float h, float r, float g, float bl)
 {
-    GLfloat vertex_buffer_data[ ] = {
-        0, 0, 0, b, 0, 0, b, h, 0, b, h, 0, 0, h, 0, 0, 0 , 0,        //1
-        0, 0, 0, 0, h, 0, 0, h, l, 0, h, l, 0, 0, l, 0, 0, 0,    //2
-        0, 0, 0, 0, 0, l, b, 0, l, b, 0, l, b, 0, 0, 0, 0, 0,        //3 
+    MeshKey key = {l, b, h, r, g, bl};
+    map<MeshKey, MeshEntry>::iterator it = meshes.find(key);
+    if(it != meshes.end())
+    {
+        it->second.refs++;
+        return it->second.object;
+    }
 
-        0, 0, l, b, 0, l, b, h, l, b, h, l, 0, h, l, 0, 0, l,        //4
-        b, 0, l, b, 0, 0, b, h, 0, b, h, 0, b, h, l, b, 0, l,            //5
-        0, h, l, b, h, l, b, h, 0, b, h, 0, 0, h, 0, 0, h, l         //6
-    };
-    GLfloat color_buffer_data [ ] = {
-    r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl,
-        r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl,
-        r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl,
-        
-        r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl,
-        r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl,
-        r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl, r, g, bl
-    };
-    box = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    GLfloat color_buffer_data[108];
+    for(int k = 0; k < 36; k++)
+    {
+        color_buffer_data[3*k] = r;
+        color_buffer_data[3*k + 1] = g;
+        color_buffer_data[3*k + 2] = bl;
+    }
+    PackedVertex vertices[36];
+    GLubyte indices[36];
+    int numvertices = boxmesh(l, b, h, color_buffer_data, vertices, indices);
+
+    MeshEntry entry = { createIndexed3DObject(GL_TRIANGLES, numvertices, vertices, 36, indices, GL_FILL), 1 };
+    meshes[key] = entry;
+    meshkeys[entry.object] = key;
+    return entry.object;
+}
 
-    //Create the Base temporary object here corresponding to the name and this gets sorted
+/* Drop one reference to a registry mesh, deleting it with the last one */
+void releaseMesh(VAO* vao)
+{
+    map<VAO*, MeshKey>::iterator k = meshkeys.find(vao);
+    if(k == meshkeys.end())
+        return;
 
-	Base tempobj = {};
-	tempobj.rgb_color = {r,g,bl};
-	tempobj.object = box;
-	tempobj.x=x;
-	tempobj.y=y;
-    tempobj.z=z;
-	tempobj.height=h;
-	tempobj.width=b;
-	tempobj.status=1;
-	tempobj.inAir=0;
-	tempobj.angle=0;
-	tempobj.x_speed=0;
-	tempobj.y_speed=0;
-	tempobj.fixed=0;
-	tempobj.radius=(sqrt(h*h + b*b))/2;
-	tempobj.friction=0.4;
-	tempobj.health=100;
-//	tempobj.weight=weight;
+    map<MeshKey, MeshEntry>::iterator it = meshes.find(k->second);
+    if(--it->second.refs > 0)
+        return;
 
-    tiles[i][j]=tempobj;
+    meshes.erase(it);
+    meshkeys.erase(k);
+    delete vao;
 }
 
 void createBlock(float l, float b, float h, float r, float g, float bl, float x, float y , float z, int i, int j)
 {
-    GLfloat vertex_buffer_data[ ] = {
-        0, 0, 0, b, 0, 0, b, h, 0, b, h, 0, 0, h, 0, 0, 0 , 0,        //1
-        0, 0, 0, 0, h, 0, 0, h, l, 0, h, l, 0, 0, l, 0, 0, 0,    //2
-        0, 0, 0, 0, 0, l, b, 0, l, b, 0, l, b, 0, 0, 0, 0, 0,        //3 
-
-        0, 0, l, b, 0, l, b, h, l, b, h, l, 0, h, l, 0, 0, l,        //4
-        b, 0, l, b, 0, 0, b, h, 0, b, h, 0, b, h, l, b, 0, l,            //5
-        0, h, l, b, h, l, b, h, 0, b, h, 0, 0, h, 0, 0, h, l         //6
-    };
     GLfloat color_buffer_data [ ] = {
     0.583f,  0.771f,  0.014f,
     0.609f,  0.115f,  0.436f,
@@ -1091,7 +3146,10 @@ void createBlock(float l, float b, float h, float r, float g, float bl, float x,
     0.820f,  0.883f,  0.371f,
     0.982f,  0.099f,  0.879f
     };
-    block = create3DObject(GL_TRIANGLES, 36, vertex_buffer_data, color_buffer_data, GL_FILL);
+    PackedVertex vertices[36];
+    GLubyte indices[36];
+    int numvertices = boxmesh(l, b, h, color_buffer_data, vertices, indices);
+    block = createIndexed3DObject(GL_TRIANGLES, numvertices, vertices, 36, indices, GL_FILL);
 
     //Create the Base temporary object here corresponding to the name and this gets sorted
 
@@ -1106,6 +3164,8 @@ void createBlock(float l, float b, float h, float r, float g, float bl, float x,
 	tempobj.height=h;
 	tempobj.width=b;
     tempobj.length=0.3f;
+    tempobj.rotate_matrix=glm::mat4(1.0f);
+    tempobj.transform.dirty=1;
 	tempobj.status=1;
 	tempobj.inAir=0;
 	tempobj.angle=0;
@@ -1122,6 +3182,50 @@ void createBlock(float l, float b, float h, float r, float g, float bl, float x,
 
 }
 
+// Acquires the box of each tile colour for the immediate path, then releases
+// the previous level's, so only boxes no level uses any more are deleted
+void createTileMeshes()
+{
+    VAO* previous[TILE_COLOURS];
+    for(int c = 0; c < TILE_COLOURS; c++)
+    {
+        previous[c] = tilemeshes[c];
+        tilemeshes[c] = acquireBoxMesh(TILE_SIZE, TILE_SIZE, TILE_DEPTH, tilepalette[c].r, tilepalette[c].g, tilepalette[c].b);
+    }
+    for(int c = 0; c < TILE_COLOURS; c++)
+        if(previous[c])
+            releaseMesh(previous[c]);
+}
+
+// Creates the shared tile mesh and its instance buffer for the instanced path
+void createTileBatch(float l, float b, float h)
+{
+    GLfloat color_buffer_data[108];
+    for(int k = 0; k < 108; k++)
+        color_buffer_data[k] = 1;
+    PackedVertex vertices[36];
+    GLubyte indices[36];
+    int numvertices = boxmesh(l, b, h, color_buffer_data, vertices, indices);
+
+    tilebatch.mesh = createIndexed3DObject(GL_TRIANGLES, numvertices, vertices, 36, indices, GL_FILL);
+    tilebatch.NumInstances = 0;
+    tilebatch.dirty = true;
+
+    cachedBindVertexArray (tilebatch.mesh->VertexArrayID);
+
+    // Colour and offset come from the instance buffer, advancing once per tile
+    tilebatch.InstanceBuffer = GLObject(GLK_BUFFER);
+    cachedBindBuffer (GL_ARRAY_BUFFER, tilebatch.InstanceBuffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(TileInstance), (void*)(3*sizeof(GLfloat)));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(TileInstance), (void*)0);
+    glVertexAttribDivisor(2, 1);
+
+    cachedBindVertexArray (0);
+}
+
 // Creates the rectangle object used in this sample code
 void createRectangle ()
 {
@@ -1154,26 +3258,14 @@ float camera_rotation_angle = 45.0f;
 float rectangle_rotation = 0;
 float triangle_rotation = 0;
 
-//TIME LAPSE AT SWITCH
-double t1;
-double t2;
 
 
 
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw (GLFWwindow* window, float x, float y, float w, float h)
+/* Choose the camera matrix of the named camera. Cameras that wait for input
+   (the helicopter needs the mouse held) keep their last matrix. */
+void cameraview (View camera, glm::mat4& viewmatrix)
 {
-    int fbwidth, fbheight;
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
-    glViewport(0, 0, (int)(w*fbwidth), (int)(h*fbheight));
-
-
-    // use the loaded shader program
-    // Don't change unless you know what you are doing
-    glUseProgram(programID);
-
-    if(view=="default")
+    if(camera==VIEW_DEFAULT)
     { 
     // Eye - Location of camera. Don't change unless you are sure!!
    // glm::vec3 eye ( 3*cos(camera_rotation_angle*M_PI/180.0f), 3, 3*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -1185,13 +3277,13 @@ void draw (GLFWwindow* window, float x, float y, float w, float h)
     glm::vec3 up (0, 1, 0);
 
     // Compute Camera matrix (view)
-    // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+    // viewmatrix = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
     //  Don't change unless you are sure!!
-    Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
+    viewmatrix = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
     }
 
 
-    if(view=="helicopter" && mousepress==1)
+    if(camera==VIEW_HELICOPTER && mousepress==1)
     {
         
 
@@ -1203,53 +3295,20 @@ void draw (GLFWwindow* window, float x, float y, float w, float h)
     glm::vec3 up (0, 1, 0);
 
     // Compute Camera matrix (view)
-    // Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+    // viewmatrix = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
     //  Don't change unless you are sure!!
-    Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
+    viewmatrix = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
     }
 
-    if(view=="top")
+    if(camera==VIEW_TOP)
     {
-         
-         
-         if(level=="level1")
-         {
-             glm::vec3 eye ( 1.1,3,1);
-
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-    glm::vec3 target (1.1,0,1);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-    glm::vec3 up (-1,0,0);
-         Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
-
-         }
-
-
-         else if(level=="level2")
-         {
-             glm::vec3 eye ( 2.5,4,0);
-
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-             glm::vec3 target (2.5,0,0);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-             glm::vec3 up (-1,0,0);
-         Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
-
-         }
-         else if(level=="level3")
-         {
-             glm::vec3 eye ( 2.8,4,0);
-
-    // Target - Where is the camera looking at.  Don't change unless you are sure!!
-             glm::vec3 target (2.8,0,0);
-    // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-             glm::vec3 up (-1,0,0);
-         Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
-
-         }
+         glm::vec3 eye (board.header->topeye[0], board.header->topeye[1], board.header->topeye[2]);
+         glm::vec3 target (board.header->toptarget[0], board.header->toptarget[1], board.header->toptarget[2]);
+         glm::vec3 up (-1,0,0);
+         viewmatrix = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
     }
 
-    if(view=="block")
+    if(camera==VIEW_BLOCK)
     {
         glm::vec3 eye ( Blockobj.x-0.8f,1.6f ,Blockobj.z);
 
@@ -1257,11 +3316,11 @@ void draw (GLFWwindow* window, float x, float y, float w, float h)
     glm::vec3 target (-1000.0f, -100, Blockobj.z);
     // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
     glm::vec3 up (0, 1, 0);
-     Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
+     viewmatrix = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
 
     }
 
-    if(view=="followcam")
+    if(camera==VIEW_FOLLOW)
     {
          glm::vec3 eye ( Blockobj.x+1.2f,Blockobj.y+0.8f,Blockobj.z);
 
@@ -1269,21 +3328,182 @@ void draw (GLFWwindow* window, float x, float y, float w, float h)
     glm::vec3 target (-1000.0f,-100,Blockobj.z);
     // Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
     glm::vec3 up (0, 1, 0);
-     Matrices.view = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
+     viewmatrix = glm::lookAt(eye, target, up)*glm::scale(glm::vec3(exp(camera_zoom))); // Fixed camera for 2D (ortho) in XY plane
+
+    }
+}
+
+//Stand the block on cell [i][j]
+void placeblock (int i, int j)
+{
+    Blockobj.i=i;
+    Blockobj.j=j;
+    Blockobj.x=j*0.3f;
+    Blockobj.z=i*0.3f;
+    setorientation(STANDING);
+    landblock();
+}
+
+//Put the block back on the spawn cell and take a life
+void respawnblock ()
+{
+    lives--;
+    placeblock(board.header->spawni, board.header->spawnj);
+}
 
+/* Load level n, take its tile meshes and stand the block on its spawn cell */
+bool startlevel (int n)
+{
+    if(!readlevel(n))
+        return false;
+    level = n;
+    createTileMeshes();
+    buildtriggers();
+    placeblock(board.header->spawni, board.header->spawnj);
+    return true;
+}
+
+/* Advance the game rules by one SIM_DT step: falling and lives */
+void updatescene ()
+{
+    PROFILE_ZONE("updatescene");
+    //Switches and fragile tiles did their part when the block landed
+    if(falling)
+        Blockobj.y -=0.1f;
+
+    if(Blockobj.y <= -25.0f )
+        respawnblock();
+    
+      
+    // Increment angles
+    float increments = 1;
+
+    //camera_rotation_angle++; // Simulating camera rotation
+    //  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
+    //  rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+}
+
+//SIMULATION
+//The game rules advance in fixed SIM_DT steps whatever the frame rate. Frame
+//time feeds an accumulator, each whole step runs updatescene once, and the
+//leftover fraction interpolates the block between its last two steps.
+#define SIM_HZ 60
+#define SIM_DT (1.0/SIM_HZ)
+//Longest frame fed to the accumulator, so a stall does not cause a burst of catch-up steps
+#define SIM_MAX_FRAME 0.25
+
+typedef struct SimState {
+    GLfloat x, y, z;
+} SimState;
+
+struct Simulation {
+    double last;        //Time simulated up to
+    double accumulator; //Time not simulated yet
+    SimState previous;  //Block before and after the latest step
+    SimState current;
+    double alpha;       //Fraction of a step the frame is past current
+    long steps;
+} sim;
+
+SimState blockstate ()
+{
+    SimState state = { Blockobj.x, Blockobj.y, Blockobj.z };
+    return state;
+}
+
+bool samestate (const SimState& a, const SimState& b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+/* Start the clock at now with one step due, so the first frame simulates like every other */
+void startsimulation (double now)
+{
+    sim.last = now;
+    sim.accumulator = SIM_DT;
+    sim.previous = sim.current = blockstate();
+}
+
+/* Run the fixed steps covered by the time since the last call */
+void simulate (double now)
+{
+    PROFILE_ZONE("simulate");
+    // Moves made outside the steps (keys, level switches) snap instead of interpolating
+    if(!samestate(blockstate(), sim.current))
+        sim.previous = sim.current = blockstate();
+
+    sim.accumulator += min(now - sim.last, (double)SIM_MAX_FRAME);
+    sim.last = now;
+    // Tolerate rounding, so frames at exactly SIM_HZ take one step each
+    while(sim.accumulator >= SIM_DT - 1e-9)
+    {
+        // A queued move starts here, so it snaps like a key press
+        steproll(SIM_DT);
+        sim.previous = blockstate();
+        updatescene();
+        sim.current = blockstate();
+        sim.accumulator -= SIM_DT;
+        sim.steps++;
+
+        // A respawn teleports the block rather than moving it
+        if(fabs(sim.current.x - sim.previous.x) > 1 || fabs(sim.current.y - sim.previous.y) > 1 || fabs(sim.current.z - sim.previous.z) > 1)
+            sim.previous = sim.current;
+    }
+    sim.alpha = max(0.0, sim.accumulator/SIM_DT);
+}
+
+/* Per-frame render data shared by every view: tiles, baked mesh and the
+   block's matrix. Built once, after updatescene and before the first draw. */
+void preparescene ()
+{
+    PROFILE_ZONE("preparescene");
+    preparetiles(board.header->rows, board.header->cols, board.generation);
+
+    framescene.models[FRAME_IDENTITY] = glm::mat4(1.0f);
+    // Draw the block between its last two simulated positions
+    float back = sim.alpha - 1;
+    glm::vec3 offset (back*(sim.current.x - sim.previous.x), back*(sim.current.y - sim.previous.y), back*(sim.current.z - sim.previous.z));
+    framescene.models[FRAME_BLOCK] = glm::translate(offset) * rollmodel(updatetransform(Blockobj), sim.alpha*SIM_DT);
+}
+
+/* Render the scene with openGL */
+/* Draw the prepared scene into the viewport (x, y, w, h), given as fractions of
+   the framebuffer, through the named camera. Only culling and draw submission
+   happen per view. */
+void draw (GLFWwindow* window, float x, float y, float w, float h, View camera, glm::mat4& viewmatrix)
+{
+    PROFILE_ZONE("draw");
+    int fbwidth, fbheight;
+    getframebuffersize(window, &fbwidth, &fbheight);
+    glViewport((int)(x*fbwidth), (int)(y*fbheight), (int)(w*fbwidth), (int)(h*fbheight));
+
+    // An inset view starts from its own background and depth
+    bool overlay = w < 1 || h < 1;
+    if(overlay)
+    {
+        gpubegin(GPU_OVERLAYS);
+        glEnable(GL_SCISSOR_TEST);
+        glScissor((int)(x*fbwidth), (int)(y*fbheight), (int)(w*fbwidth), (int)(h*fbheight));
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_SCISSOR_TEST);
     }
+
+    // use the loaded shader program
+    // Don't change unless you know what you are doing
+    cachedUseProgram(programID);
+
+    cameraview(camera, viewmatrix);
+
     // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
     //  Don't change unless you are sure!!
     //glm::mat4 VP = (proj_type?Matrices.projectionP:Matrices.projectionO) * Matrices.view;
-    glm::mat4 VP = Matrices.projectionP * Matrices.view;
-
-    // Send our transformation to the currently bound shader, in the "MVP" uniform
-    // For each model you render, since the MVP will be different (at least the M part)
-    //  Don't change unless you are sure!!
-    glm::mat4 MVP;	// MVP = Projection * View * Model
+    // projectionP has the aspect of the whole window; correct it for this viewport
+    Matrices.VP = glm::scale(glm::vec3(h/w, 1, 1)) * Matrices.projectionP * viewmatrix;
 
-    // Load identity to model matrix
-    Matrices.model = glm::mat4(1.0f);
+    // Stream this view's VP into the "Camera" block shared by all programs;
+    // each object then only picks its model matrix and the GPU does VP * M
+    framescene.models[FRAME_CAMERA] = Matrices.VP;
+    streamframescene();
 
     /* Render your scene */
     /*
@@ -1319,225 +3539,22 @@ void draw (GLFWwindow* window, float x, float y, float w, float h)
     glm::mat4 rotatebox = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); // rotate about vector (-1,1,1)
     Matrices.model *= (translatebox * rotatebox);
     MVP = VP * Matrices.model;
-    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);   */ 
-   
-    if(level=="level1")
-       
-       {
-            drawtiles(6,10, "level1");
-            
-            if( level1[Blockobj.i][Blockobj.j] ==0 || Blockobj.i <0 ||  Blockobj.i > 5 || Blockobj.j <0 || Blockobj.j >9 )
-
-                    {
-                        Blockobj.y -=0.1f;
-                    }
-            if(bstatus=="up" && level1[Blockobj.i][Blockobj.j] == 3 )
-                    {
-                        Blockobj.y -=0.1f;
-                    }
-                       /* cout << " HI I AM " << (int)(Blockobj.z/0.3f) << endl;
-                        cout << " Hw I AM " << (int)(Blockobj.x/0.3f) << endl;
-                        cout << "status is " << bstatus;*/
-
-                    
-
-            if(Blockobj.y <= -25.0f )
-                        {
-                            
-
-                            Blockobj.x=0.3f;
-                            Blockobj.y=1.0f;
-                            Blockobj.z=0.3f;
-
-                            lives--;
-
-                            Blockobj.i=1;
-                            Blockobj.j=1;
-             if (bstatus=="horizdown")
-               {
-                  Blockobj.z = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-
-                    renderblock();
-                    
-                    bstatus="up";
-               }
-            else if (bstatus=="lateraldown")
-                     {
-                    Blockobj.x = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 0,0,1 ) );
-                    renderblock();
-                    bstatus="up";
-                    
-                     }
-             }
-                    
-            
-       }
-                        
-    
-    if(level=="level2")
-       {
-
-        drawtiles(6,15, "level2");
-                                //cout << "status is " << bstatus << endl;
-
-         if( ( (level2[Blockobj.i][Blockobj.j] ==0)) || (Blockobj.i <0 ||  Blockobj.j < 0 || Blockobj.i >=15 || Blockobj.j>= 15))
-                     Blockobj.y -=0.1f;
-         
-          /*if(bstatus=="up" && level2[(int)((Blockobj.z/0.3f))][(int)(((Blockobj.x/0.3f)))] == 3   )
-                    {
-                        Blockobj.y -=0.1f;
-                        cout << " HI I AM " << (Blockobj.x) << endl;
-                        cout << " Hw I AM " << (int)(Blockobj.x/0.3f) << endl;
-                        cout << "status is " << bstatus;
-
-                    }*/
-
-        //Fragile on level 2
-        if(bstatus=="up" && level2[Blockobj.i][Blockobj.j]==3)
-        {
-            Blockobj.y -=0.1f;
-                        /*cout << " HI I AM lllllll  X IS " << Blockobj.x<< endl;
-                        cout << " Hw I AM Z IS " << Blockobj.z << endl;
-                        cout << "status is " << bstatus;*/
-        }
-         if(Blockobj.y <= -25.0f )
-                        {
-
-                            Blockobj.x=0.3f;
-                            Blockobj.y=1.0f;
-                            Blockobj.z=0.3f;
-
-                            lives--;
-
-                            Blockobj.i=1;
-                            Blockobj.j=1;
-             if (bstatus=="horizdown")
-               {
-                  Blockobj.z = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-
-                    renderblock();
-                    
-                    bstatus="up";
-               }
-            else if (bstatus=="lateraldown")
-                     {
-                    Blockobj.x = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 0,0,1 ) );
-                    renderblock();
-                    bstatus="up";
-                    
-                     }
-             }
-       }
- 
-
-    if(level=="level3")
-    {           t2 = glfwGetTime(); //NOT WORKING. SEARCH FOR A DIFFERENT SOLUTION!
-
-        drawtiles(6,15,"level3");
-        
-        //BRIDGE LEVELS
-        if(Blockobj.i==2  && Blockobj.j==2 )
-             {
-                   level3[4][4]=1;
-                      level3[4][5]=1;
-             }     
-
+    glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);   */
 
+    gpubegin(GPU_TILES);
+    drawtiles(Matrices.VP);
+    gpuend(GPU_TILES);
 
-        if(Blockobj.j==8  && Blockobj.i==1 )
-             {
-                    level3[4][10]=1;
-                    level3[4][11]=1;
-             }
-        
-        
-         if(level3[Blockobj.i][Blockobj.j] ==0 || (Blockobj.i <0 ||  Blockobj.j < 0 || Blockobj.j >=15 || Blockobj.i >= 15))
-                    Blockobj.y -=0.1f;  
-
-        //Fragile tiles
-        if(bstatus=="up" && Blockobj.j==3 && Blockobj.i==2)
-                    {
-                        Blockobj.y -=0.1f;
-                        /*cout << " HI I AM " << (int)(Blockobj.z/0.3f) << endl;
-                        cout << " Hw I AM " << (int)(Blockobj.x/0.3f) << endl;
-                        cout << "status is " << bstatus;*/
-
-                    }
-      //Frgaile tiles
-        if(bstatus=="up" && Blockobj.j==12 && Blockobj.i==3 )
-                    {
-                        Blockobj.y -=0.1f;
-                        /*cout << " HI I AM " << (int)(Blockobj.z/0.3f) << endl;
-                        cout << " Hw I AM " << (int)(Blockobj.x/0.3f) << endl;
-                        cout << "status is " << bstatus;*/
-
-                    }
-         if(Blockobj.y <= -25.0f )
-                        {
-
-                            Blockobj.x=0.3f;
-                            Blockobj.y=1.0f;
-                            Blockobj.z=0.3f;
-
-                            lives--;
-
-                            Blockobj.i=1;
-                            Blockobj.j=1;
-             if (bstatus=="horizdown")
-               {
-                  Blockobj.z = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 1,0,0 ) );
-
-                    renderblock();
-                    
-                    bstatus="up";
-               }
-            else if (bstatus=="lateraldown")
-                     {
-                    Blockobj.x = 0.3f;
-                  Blockobj.y = 1.0f;
-                   
-                    blockrotator ( 0.0f, glm::vec3 ( 0,0,1 ) );
-                    renderblock();
-                    bstatus="up";
-                    
-                     }
-             }
-
-    if( fabs(Blockobj.x-3.9f)<0.1f && fabs(Blockobj.z-0.3f)<0.1f && bstatus=="up")
-        {
-        cout << "Congrats you win!"<<endl;
-          glfwDestroyWindow(window);
-          glfwTerminate();
-          exit(EXIT_SUCCESS);
-     }
+    {
+    PROFILE_ZONE("renderblock");
+    gpubegin(GPU_BLOCK);
+    bindstreamslot(MODEL_BINDING, framesceneslot(FRAME_BLOCK));
+    draw3DObject(Blockobj.object);
+    gpuend(GPU_BLOCK);
     }
 
-    
-    renderblock();
-    t1=t2;
-    
-      
-    // Increment angles
-    float increments = 1;
-
-    //camera_rotation_angle++; // Simulating camera rotation
-    //  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-    //  rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
+    if(overlay)
+        gpuend(GPU_OVERLAYS);
 }
 
 /* Initialise glfw window, I/O callbacks and the renderer to use */
@@ -1564,7 +3581,7 @@ GLFWwindow* initGLFW (int width, int height){
 
     glfwMakeContextCurrent(window);
     //    gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-    glfwSwapInterval( 1 );
+    glfwSwapInterval( present_mode == PRESENT_VSYNC ? 1 : 0 );
     glfwSetFramebufferSizeCallback(window, reshapeWindow);
     glfwSetWindowSizeCallback(window, reshapeWindow);
     glfwSetWindowCloseCallback(window, quit);
@@ -1620,34 +3637,37 @@ void initGL (GLFWwindow* window, int width, int height)
     //LEVEL 2
     else if(level=="level2")
     {*/
-        for(int i = 0; i < 100; i++ ){
-         x_ordinate = 0.0f;
-        for(int j = 0; j < 100;j++){
-            
-            if((i + j) % 2 == 0){
-                y_ordinate =  1.0f;
-                createBox(0.3f, 0.3f, -0.1f, 238.0/256.0, 47.0/256.0, 127.0/256.0, x_ordinate, y_ordinate, z_ordinate, i, j);
-               
-            }
-            else{
-                y_ordinate =  1.0f;
-                createBox(0.3f, 0.3f, -0.1f,59.0/256.0, 28.0/256.0, 180.0/256.0, x_ordinate, y_ordinate, z_ordinate, i, j);
-                
-            }
-            x_ordinate += 0.3f;
-        }
-        z_ordinate += 0.3f;
-    }
     x_ordinate = 0.3f;
     y_ordinate = 1.0f ;
     z_ordinate = 0.3f;
     createBlock(0.3f, 0.3f, 0.6f, 0.47, 0.3,0.56,x_ordinate, y_ordinate, z_ordinate, 1 , 1);
+    createTileBatch(TILE_SIZE, TILE_SIZE, TILE_DEPTH);
     
 
     // Create and compile our GLSL program from the shaders
-    programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-    // Get a handle for our "MVP" uniform
-    Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+    programID = GLObject(GLK_PROGRAM, LoadCachedProgram( Sample_GL_vert, Sample_GL_frag, "Sample_GL" ));
+
+    // Instanced tiles take only the camera, the offset is per instance
+    instancedProgramID = GLObject(GLK_PROGRAM, LoadCachedProgram( Sample_GL_instanced_vert, Sample_GL_frag, "Sample_GL_instanced" ));
+    if(!programID || !instancedProgramID)
+    {
+        fprintf(stderr, "Could not build the shader programs\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Shader programs: %d from cache, %d compiled\n", programs_cached, programs_compiled);
+
+    // Timer queries are core in 3.3; only benchmark runs pay for them
+    if(benchmark && (GLEW_VERSION_3_3 || GLEW_ARB_timer_query))
+    {
+        gpu_timers = true;
+        createGPUTimers();
+    }
+
+    // Camera and model matrices are streamed per frame and picked per draw with glBindBufferRange
+    createStreamBuffer();
+    glUniformBlockBinding (programID, glGetUniformBlockIndex(programID, "Camera"), CAMERA_BINDING);
+    glUniformBlockBinding (instancedProgramID, glGetUniformBlockIndex(instancedProgramID, "Camera"), CAMERA_BINDING);
+    glUniformBlockBinding (programID, glGetUniformBlockIndex(programID, "Model"), MODEL_BINDING);
 
 
     reshapeWindow (window, width, height);
@@ -1673,92 +3693,145 @@ int main (int argc, char** argv)
     proj_type = 1;
     tri_pos = glm::vec3(0, 0, 0);
     rect_pos = glm::vec3(0, 0, 0);
-
-    GLFWwindow* window = initGLFW(width, height);
+    bool solve = false;
+    string validate;
+    int threads = 0;
+    int generate = 0;
+    string generatedir;
+    GeneratorSettings generator = { 10, 15, 20, (unsigned)time(NULL), 100000 };
+
+    for(int k = 1; k < argc; k++)
+    {
+        if(string(argv[k])=="--immediate")
+            tile_path = TILES_IMMEDIATE;
+        else if(string(argv[k])=="--instanced")
+            tile_path = TILES_INSTANCED;
+        else if(string(argv[k])=="--nocull")
+            cull_tiles = false;
+        else if(string(argv[k])=="--minimap")
+            minimap = true;
+        else if(string(argv[k])=="--headless")
+            headless = benchmark = noaudio = true;
+        else if(string(argv[k])=="--noaudio")
+            noaudio = true;
+        else if(string(argv[k])=="--benchmark")
+            benchmark = true;
+        else if(string(argv[k])=="--trace" && k + 1 < argc)
+        {
+            trace_path = argv[++k];
+            trace_at_exit = true;
+        }
+        else if(string(argv[k])=="--present" && k + 1 < argc)
+        {
+            string mode = argv[++k];
+            if(mode=="vsync")
+                present_mode = PRESENT_VSYNC;
+            else if(mode=="uncapped")
+                present_mode = PRESENT_UNCAPPED;
+            else if(atof(mode.c_str()) > 0)
+            {
+                present_mode = PRESENT_FIXED;
+                target_fps = atof(mode.c_str());
+            }
+            else
+                fprintf(stderr, "Unknown present mode %s, expected vsync, uncapped or a frame rate\n", mode.c_str());
+        }
+        else if(string(argv[k])=="--frames" && k + 1 < argc)
+            headless_frames = atoi(argv[++k]);
+        else if(string(argv[k])=="--solve")
+            solve = true;
+        else if(string(argv[k])=="--validate" && k + 1 < argc)
+            validate = argv[++k];
+        else if(string(argv[k])=="--threads" && k + 1 < argc)
+            threads = atoi(argv[++k]);
+        else if(string(argv[k])=="--generate" && k + 2 < argc)
+        {
+            generate = atoi(argv[++k]);
+            generatedir = argv[++k];
+        }
+        else if(string(argv[k])=="--size" && k + 1 < argc)
+        {
+            if(sscanf(argv[++k], "%dx%d", &generator.rows, &generator.cols) != 2)
+                fprintf(stderr, "Unknown size %s, expected rows x cols such as 10x15\n", argv[k]);
+        }
+        else if(string(argv[k])=="--difficulty" && k + 1 < argc)
+            generator.difficulty = atoi(argv[++k]);
+        else if(string(argv[k])=="--seed" && k + 1 < argc)
+            generator.seed = strtoul(argv[++k], NULL, 10);
+        else if(string(argv[k])=="--candidates" && k + 1 < argc)
+            generator.candidates = strtoul(argv[++k], NULL, 10);
+    }
+    if(solve)
+        return solvelevels();
+    if(!validate.empty())
+        return validatelevels(validate, threads);
+    if(generate > 0)
+        return generatelevels(generate, generatedir, generator, threads);
+
+    GLFWwindow* window = NULL;
+    if(headless)
+        initHeadless(width, height);
+    else
+        window = initGLFW(width, height);
     initGLEW();
+    if(headless)
+        createOffscreenFramebuffer();
     initGL (window, width, height);
     audio_init();
 
 
-    double last_update_time = glfwGetTime(), current_time;
-t1 = glfwGetTime();
+    double last_update_time = gettime(), current_time;
+
+    if(!startlevel(1))
+        exit(EXIT_FAILURE);
+
     /* Draw in loop */
-    while (!glfwWindowShouldClose(window)) {
+    int frames = 0;
+    startsimulation(gettime());
+    while (headless ? frames < headless_frames : !glfwWindowShouldClose(window)) {
+    PROFILE_ZONE("frame");
+    double framestart = gettime();
+    gpubegin(GPU_FRAME);
 
 	// clear the color and depth in the frame buffer
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     //Get the mouse cursor position      
-    glfwGetCursorPos(window, &leftmouse_x, &leftmouse_y);
+    if(!headless)
+        glfwGetCursorPos(window, &leftmouse_x, &leftmouse_y);
     
     theta = (leftmouse_x*360.0f)/1000.0f;
 
 
-      // OpenGL Draw commands
-	draw(window, 0, 0, 1, 1);
-
-    audio_play();
-    if(level=="level1")
-    {
-       createBox(0.3f, 0.3f, -0.1f, 100.0/256.0, 117.0/256.0, 167.0/256.0, 0.9f, 1.0f, 0.6f, 2, 3);
-        createBox(0.3f, 0.3f, -0.1f, 100.0/256.0, 117.0/256.0, 167.0/256.0, 2.4f, 1.0f, 1.2f, 4, 8);
-
-    }
-
-    if(level=="level1" && level1[Blockobj.i][Blockobj.j]==4  && bstatus=="up" )
-            {   level="level2";
-                Blockobj.i=1;
-                Blockobj.j=1;
-                Blockobj.x=0.3f;
-                Blockobj.y=1.0f;
-                Blockobj.z=0.3f;
-                count=0;
-                cout << "SWITCHED LEVEL to LEVEL 2!";
-                //if(level2[2][3]==3)
-                 createBox(0.3f, 0.3f, -0.1f, 238.0/256.0, 47.0/256.0, 127.0/256.0, 0.9f, 1.0f, 0.6f, 2, 3);
-                 //if(level2[4][8]==3)
-                 createBox(0.3f, 0.3f, -0.1f, 238.0/256.0, 47.0/256.0, 127.0/256.0, 2.4f, 1.0f, 1.2f, 4, 8);
-
-                Blockobj.x =0.3f;
-                Blockobj.y=1.0f;
-                Blockobj.z=0.3f;
+    simulate(framestart);
+    preparescene();
 
-                 createBox(0.3f, 0.3f, -0.1f, 100.0/256.0, 117.0/256.0, 167.0/256.0, 0.9f, 1.0f, 0.6f, 2, 3);
-                 createBox(0.3f, 0.3f, -0.1f, 100.0/256.0, 117.0/256.0, 167.0/256.0, 3.6f, 1.0f, 0.9f, 3, 12);
-
-                
+      // OpenGL Draw commands
+	draw(window, 0, 0, 1, 1, view, Matrices.view);
+    if(minimap)
+        draw(window, 0.7f, 0.7f, 0.3f, 0.3f, VIEW_TOP, minimapview);
 
-                cout << "level2";
-                flag=2;
-               
-            }
-    if( level=="level2" && level2[Blockobj.i][Blockobj.j]==4 && bstatus=="up" )
+    //Standing on the goal moves on to the next level, or wins after the last
+    if(atgoal && !roll.active)
     {
-                        cout << "SWITCHED LEVEL to LEVEL 3!";
-
-        count=0;
-        Blockobj.i=4;
-       Blockobj.j=1;
-        Blockobj.x = 0.3f;
-        Blockobj.y=1.0f;
-        Blockobj.z=1.2f;
-        level="level3";
-        flag=3;
-        createBox(0.3f, 0.3f, -0.1f, 200.0/256.0, 147.0/256.0, 27.0/256.0, 2.4f, 1.0f, 0.3f, 1, 8);
-        createBox(0.3f, 0.3f, -0.1f, 200.0/256.0, 147.0/256.0, 27.0/256.0, 0.6f, 1.0f, 0.6f, 2,2);
-
-
+        if(!levelexists(level + 1))
+        {
+            cout << "Congrats you win!"<<endl;
+            quit(window);
+        }
+        if(!startlevel(level + 1))
+            exit(EXIT_FAILURE);
+        movecount=0;
+        cout << "SWITCHED LEVEL to LEVEL " << level << "!";
     }
 
     if(lives<=0)
     {
         cout << "SORRY YOU LOSE!"<<endl;
-       cout << "YOUR FINAL NO. OF MOVES FOR THIS LEVEL: " << count << endl;
+       cout << "YOUR FINAL NO. OF MOVES FOR THIS LEVEL: " << movecount << endl;
 
 
-          glfwDestroyWindow(window);
-          glfwTerminate();
-          exit(EXIT_SUCCESS);
+          quit(window);
 
     }
 
@@ -1767,29 +3840,68 @@ t1 = glfwGetTime();
 	// draw(window, 0.5, 0, 0.5, 1);
 	// proj_type ^= 1;
 
+        gpuend(GPU_FRAME);
+        gpuendframe();
+        streamendframe();
+        double frameready = gettime();
+
+        if(headless)
+        {
+            // No swap to pace the GPU, so wait for it to count its share of the frame
+            glFinish();
+        }
+        else
+        {
+        PROFILE_ZONE("glfwSwapBuffers");
         // Swap Frame Buffer in double buffering
         glfwSwapBuffers(window);
+        }
+        paceframe();
+        frames++;
+        if(benchmark)
+            recordframe(framestart, frameready, gettime(), glstate.draws);
+
+        // Feed the music between frames, where it doesn't count as frame time
+        double audiostart = gettime();
+        audio_play();
+        if(benchmark && !noaudio)
+            frametimes.audio.push_back(1000*(gettime() - audiostart));
 
         // Poll for Keyboard and mouse events
-        glfwPollEvents();
+        if(!headless)
+        {
+            PROFILE_ZONE("glfwPollEvents");
+            glfwPollEvents();
+        }
 
         //Print the no. of MOVES
         cout << "__________________________" << endl;
-        cout << "NO. OF MOVES: " << count << endl;
-        cout << " LEVEL IS : " << flag << endl;
+        cout << "NO. OF MOVES: " << movecount << endl;
+        cout << " LEVEL IS : " << level << endl;
         cout << "LIVES LEFT : " <<lives <<endl;
         cout << "__________________________" << endl;
 
 
 
         // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
+        current_time = gettime(); // Time in seconds
         if ((current_time - last_update_time) >= 0.5) { // atleast 0.5s elapsed since last frame
             // do something every 0.5 seconds ..
             last_update_time = current_time;
+
+            // Renderer counters of the last frame, and stream events since the last report
+            cout << "TILE CHUNKS DRAWN : " << chunkgrid.visible.size() << "/" << chunkgrid.chunks.size() << "\n";
+            cout << "GL CALLS : " << glstate.draws << " DRAWS, " << glstate.issued << " STATE ISSUED, " << glstate.skipped << " STATE SKIPPED" << "\n";
+            if(gpu_timers)
+                cout << "GPU MS (" << GPU_TIMER_FRAMES << " FRAMES AGO) : " << gputimers.last[GPU_FRAME] << " FRAME, " << gputimers.last[GPU_TILES] << " TILES, "
+                     << gputimers.last[GPU_BLOCK] << " BLOCK, " << gputimers.last[GPU_OVERLAYS] << " OVERLAYS" << "\n";
+            cout << "STREAM : " << stream.orphans << " ORPHANED, " << stream.waits << " WAITS" << "\n";
+            stream.orphans = stream.waits = 0;
+            cout << "GL OBJECTS : " << gl_live[GLK_VERTEXARRAY] << " VAO, " << gl_live[GLK_BUFFER] << " BUFFERS, " << gl_live[GLK_PROGRAM] << " PROGRAMS" << endl;
         }
+        glstate.draws = glstate.issued = glstate.skipped = 0;
     }
     audio_close();
-    glfwTerminate();
+    quit(window);
     //    exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,25 @@
+#version 330 core
+
+// input data : per-vertex cube corner, per-instance tile colour and offset
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 1) in vec4 tileColor; // normalised RGBA8
+layout (location = 2) in vec3 tileOffset;
+
+// Per-frame camera, shared by every program
+layout (std140) uniform Camera {
+    mat4 VP;
+};
+
+// output data : used by fragment shader
+out vec3 fragColor;
+
+void main ()
+{
+    // Every tile shares one mesh, so the model matrix is just a translation
+    vec4 v = vec4(vertexPosition + tileOffset, 1);
+
+    fragColor = tileColor.rgb;
+
+    // Output position of the vertex, in clip space : VP * (position + offset)
+    gl_Position = VP * v;
+}